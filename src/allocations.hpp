@@ -0,0 +1,85 @@
+#pragma once
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/resource.h>
+
+// Heap allocation accounting, for builds with MNIST_TRACK_ALLOCATIONS. Those replace the global operator new (see
+// main.cpp), which calls note for every allocation; everywhere else the counts stay 0.
+//
+// Counts are kept per thread, so reading them needs no synchronization and a thread only sees its own allocations.
+// To check that something doesn't allocate:
+//
+//   allocations::Measure measure;
+//   nn.train_batch(xs, labels, n);
+//   if (measure.elapsed().count > BUDGET) ...
+namespace allocations {
+
+#ifdef MNIST_TRACK_ALLOCATIONS
+constexpr bool TRACKING = true;
+#else
+constexpr bool TRACKING = false;
+#endif
+
+struct Counts {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+
+  Counts& operator+=(Counts const& other) {
+    this->count += other.count;
+    this->bytes += other.bytes;
+    return *this;
+  }
+
+  Counts operator-(Counts const& other) const {
+    return {.count = this->count - other.count, .bytes = this->bytes - other.bytes};
+  }
+};
+
+// Everything the calling thread allocated so far, plus what other threads charged to it
+inline Counts& this_thread() {
+  thread_local Counts counts;
+  return counts;
+}
+
+inline void note(size_t bytes) {
+  Counts& counts = this_thread();
+  ++counts.count;
+  counts.bytes += bytes;
+}
+
+// What the calling thread allocated since the Measure was made
+struct Measure {
+  Counts const start = this_thread();
+
+  Counts elapsed() const {
+    return this_thread() - this->start;
+  }
+};
+
+// The largest, the first and the total of a series of counts, e.g. one per training step
+struct Tally {
+  size_t n = 0;
+  Counts first;
+  Counts total;
+  Counts max;  // Not counting the first, which warms up the buffers
+
+  void add(Counts const& counts) {
+    if (this->n++ == 0) {
+      this->first = counts;
+    } else {
+      this->max.count = std::max(this->max.count, counts.count);
+      this->max.bytes = std::max(this->max.bytes, counts.bytes);
+    }
+    this->total += counts;
+  }
+};
+
+// The process's peak resident set size so far
+inline size_t peak_rss_bytes() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return size_t(usage.ru_maxrss) * 1024; // Linux reports kilobytes
+}
+
+}
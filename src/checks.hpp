@@ -0,0 +1,116 @@
+#pragma once
+#include "layers/function.hpp"
+#include "lenet5.hpp"
+#include "trainer.hpp"
+#include "allocations.hpp"
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+// Self checks of documented numerical properties, run by main's --check-* flags. Each prints what it measured and
+// returns false when a bound is exceeded.
+namespace checks {
+
+// |got - want| in units of the spacing of T at want
+template <class T>
+inline double ulp_error(T got, long double want) {
+  T const w = T(want);
+  T ulp = std::nextafter(w, std::numeric_limits<T>::infinity()) - w;
+  if (ulp == 0 || !std::isfinite(ulp)) ulp = std::numeric_limits<T>::denorm_min();
+  return double(std::fabs((long double)got - want) / ulp);
+}
+
+// Sweeps the sigmoid layer of every Accuracy over the inputs exp_vector handles without clamping, plus random inputs
+// in [-40, 40] where the errors peak, and compares it with 1 / (1 + exp(-x)) in long double against
+// simd::sigmoid_error_bound
+template <class T>
+bool sigmoid(std::ostream& out) {
+  size_t const N = 1 << 22;
+  double const limit = -simd::body::ExpTraits<T>::lo;
+  VecT<T> x(2 * N);
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> peak(-40, 40);
+  for (size_t i = 0; i < N; ++i) {
+    x[i] = T(-limit + 2 * limit * i / (N - 1));
+    x[N + i] = T(peak(rng));
+  }
+  std::vector<long double> want(x.size());
+  for (size_t i = 0; i < x.size(); ++i) {
+    want[i] = 1.0L / (1.0L + std::exp(-(long double)x[i]));
+  }
+
+  bool ok = true;
+  for (simd::Accuracy accuracy : {simd::Accuracy::Exact, simd::Accuracy::Accurate, simd::Accuracy::Fast}) {
+    SigmoidT<T> layer(accuracy);
+    Workspace workspace;
+    VecT<T> y;
+    layer.forward_batch(x, 1, y, workspace);
+
+    double worst = 0;
+    T worst_x = 0;
+    for (size_t i = 0; i < x.size(); ++i) {
+      double const error = accuracy == simd::Accuracy::Fast ? double(std::fabs(y[i] - want[i]) / want[i]) : ulp_error(y[i], want[i]);
+      if (!(error <= worst)) {
+        worst = error;
+        worst_x = x[i];
+      }
+    }
+    double const bound = simd::sigmoid_error_bound<T>(accuracy);
+    ok = ok && worst <= bound;
+    out << "sigmoid " << (sizeof(T) == sizeof(double) ? "double" : "float") << " " << simd::name(accuracy) << " on [" << -limit
+        << ", " << limit << "]: max error " << worst << (accuracy == simd::Accuracy::Fast ? " relative" : " ulp") << " at x = "
+        << worst_x << ", bound " << bound << (worst <= bound ? "" : " EXCEEDED") << std::endl;
+  }
+  return ok;
+}
+
+// Trains a few batches of random data through LeNet-5 on nthreads threads, then evaluates a few, and fails if any
+// but the first of each, which warm up the buffers, allocates. Needs a build with MNIST_TRACK_ALLOCATIONS, the
+// counts are 0 otherwise.
+template <class T>
+bool allocations(std::ostream& out, size_t nthreads) {
+  size_t const BATCH_SIZE = 100;
+  size_t const STEPS = 5;
+  NeuralNetworkT<T> nn = lenet5<T>();
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  auto const gen = [&](){ return uniform(rng); };
+  nn.initialize(gen);
+
+  VecT<T> xs(BATCH_SIZE * 28 * 28);
+  for (auto& x : xs.elements) {
+    x = T(0.5 + 0.5 * uniform(rng));
+  }
+  std::vector<uint8_t> labels(BATCH_SIZE);
+  for (size_t i = 0; i < BATCH_SIZE; ++i) {
+    labels[i] = i % 10;
+  }
+
+  ParallelTrainerT<T> trainer(nn, nthreads);
+  ::allocations::Tally steps;
+  for (size_t step = 0; step < STEPS; ++step) {
+    ::allocations::Measure const measure;
+    trainer.train_batch(xs, labels.data(), BATCH_SIZE);
+    nn.descend_gradient(0.1);
+    steps.add(measure.elapsed());
+  }
+
+  typename NeuralNetworkT<T>::InferenceContext context;
+  ::allocations::Tally evaluations;
+  for (size_t evaluation = 0; evaluation < STEPS; ++evaluation) {
+    ::allocations::Measure const measure;
+    nn.evaluate_batch(xs, BATCH_SIZE, context);
+    evaluations.add(measure.elapsed());
+  }
+
+  bool const ok = steps.max.count == 0 && evaluations.max.count == 0;
+  out << "allocations " << (sizeof(T) == sizeof(double) ? "double" : "float") << " on " << nthreads << " threads: "
+      << steps.first.count << " in the first training step, at most " << steps.max.count << " in the " << STEPS - 1
+      << " others; " << evaluations.first.count << " in the first evaluation, at most " << evaluations.max.count
+      << " in the others" << (ok ? "" : " FAILED") << std::endl;
+  return ok;
+}
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// Hardware performance counters of the calling thread, read through Linux perf_event_open.
+// Every thread opens its own counters the first time it reads them, as one group so they are scheduled, and read,
+// together. Counters the kernel or the CPU doesn't offer (no PMU in a VM, perf_event_paranoid, another OS) are
+// reported once and then left out, so reading always works, possibly without any counter.
+namespace counters {
+
+enum Counter {
+  Cycles,
+  Instructions,
+  L1DMisses,    // L1 data cache read misses
+  LLCMisses,    // Last level cache misses
+  BranchMisses,
+  NCOUNTERS
+};
+
+inline char const * name(size_t counter) {
+  switch (counter) {
+    case Cycles: return "cycles";
+    case Instructions: return "instructions";
+    case L1DMisses: return "L1D misses";
+    case LLCMisses: return "LLC misses";
+    case BranchMisses: return "branch misses";
+  }
+  return "?";
+}
+
+struct Sample {
+  uint64_t values[NCOUNTERS] = {};
+};
+
+// Bit i is set when counter i could be opened, by any thread
+inline std::atomic<unsigned>& available() {
+  static std::atomic<unsigned> mask{0};
+  return mask;
+}
+
+#ifdef __linux__
+struct Group {
+  int fds[NCOUNTERS];
+  size_t slots[NCOUNTERS]; // Counter i is value slots[i] of a group read
+  size_t nopen = 0;
+
+  Group() {
+    std::fill(std::begin(this->fds), std::end(this->fds), -1);
+    for (size_t i = 0; i < NCOUNTERS; ++i) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      switch (i) {
+        case Cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case Instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case L1DMisses:
+          attr.type = PERF_TYPE_HW_CACHE;
+          attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+          break;
+        case LLCMisses: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case BranchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+      }
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1; // Allowed up to perf_event_paranoid 2
+      attr.exclude_hv = 1;
+
+      int const leader = this->nopen ? this->fds[this->leader()] : -1;
+      int const fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+      if (fd < 0) {
+        report(i, errno);
+        continue;
+      }
+      this->fds[i] = fd;
+      this->slots[i] = this->nopen++;
+      available() |= 1u << i;
+    }
+  }
+
+  Group(Group const&) = delete;
+  Group& operator=(Group const&) = delete;
+
+  ~Group() {
+    for (int fd : this->fds) {
+      if (fd >= 0) close(fd);
+    }
+  }
+
+  // Counters that aren't open read 0
+  void read(Sample& sample) const {
+    if (!this->nopen) return;
+    uint64_t buffer[1 + NCOUNTERS];
+    if (::read(this->fds[this->leader()], buffer, sizeof(buffer)) < ssize_t((1 + this->nopen) * sizeof(uint64_t))) return;
+    for (size_t i = 0; i < NCOUNTERS; ++i) {
+      if (this->fds[i] >= 0) sample.values[i] = buffer[1 + this->slots[i]];
+    }
+  }
+
+  private:
+  size_t leader() const {
+    size_t i = 0;
+    while (this->fds[i] < 0) ++i;
+    return i;
+  }
+
+  // Once per counter and process, the other threads would fail the same way
+  static void report(size_t counter, int error) {
+    static std::atomic<unsigned> reported{0};
+    if (reported.fetch_or(1u << counter) & (1u << counter)) return;
+    std::cerr << "Hardware counter " << name(counter) << " is unavailable: " << strerror(error) << std::endl;
+  }
+};
+#else
+struct Group {
+  Group() {
+    static std::atomic<bool> reported{false};
+    if (!reported.exchange(true)) std::cerr << "Hardware counters need Linux perf_event_open" << std::endl;
+  }
+
+  void read(Sample&) const {}
+};
+#endif
+
+inline void read(Sample& sample) {
+  thread_local Group group;
+  group.read(sample);
+}
+
+}
@@ -1,118 +1,299 @@
+#pragma once
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <filesystem>
+#include <memory>
 #include <stdint.h>
+#include <string.h>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
-using Label = std::vector<double>;
-using Image = std::vector<double>;
+constexpr size_t NCLASSES = 10; // Labels are digits, anything else is rejected when the cache is built
+
+// The dataset is converted once from the four IDX files into a single cache file next to them, holding the raw uint8
+// pixels and the labels as class indices. Every later run maps that file and indexes
+// it in place, so loading is nearly free and processes on the same host share the page cache.
+
+// A view of one split of the dataset
 struct Images {
-    std::vector<Label> labels;
-    std::vector<Image> images;
+    size_t count;
+    size_t rows;
+    size_t columns;
+    uint8_t const * pixels; // count x rows x columns
+    uint8_t const * labels; // count class indices
+    double scale;           // Normalizes a pixel to [0, 1]
+
+    size_t size() const {
+        return this->count;
+    }
+
+    size_t image_size() const {
+        return this->rows * this->columns;
+    }
+
+    uint8_t const * image(size_t idx) const {
+        return this->pixels + idx * this->image_size();
+    }
+
+    // Writes image idx, normalized to [0, 1], to out
+    template <class T>
+    void normalize(size_t idx, T * out) const {
+        uint8_t const * const image = this->image(idx);
+        for (size_t i = 0; i < this->image_size(); ++i) {
+            out[i] = T(image[i] * this->scale);
+        }
+    }
+
+    uint8_t label(size_t idx) const {
+        return this->labels[idx];
+    }
 };
 
 struct Data {
     Images test;
     Images train;
+    std::shared_ptr<void const> storage; // The mapping or buffer the views point into
+};
+
+/*********** Cache file ********************/
+// All sections start on a cache line
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;  // Pixel type, see CacheFormat
+    double scale;     // The stored pixels times scale are in [0, 1]
+    uint32_t rows;
+    uint32_t columns;
+    uint64_t ntrain;
+    uint64_t ntest;
+    uint64_t train_pixels; // Byte offsets from the start of the file
+    uint64_t train_labels;
+    uint64_t test_pixels;
+    uint64_t test_labels;
+    uint64_t size;
+};
+
+enum class CacheFormat : uint32_t {
+    U8 = 1,
 };
 
-inline uint32_t read32be(std::ifstream& ifile) {
+constexpr char CACHE_MAGIC[8] = {'M', 'N', 'I', 'S', 'T', 'C', 'A', 'C'};
+constexpr uint32_t CACHE_VERSION = 3; // 3 validates the labels, older caches weren't
+constexpr size_t CACHE_ALIGN = 64;
+
+inline size_t cache_align(size_t offset) {
+    return (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+// Reads exactly size bytes, a short read means the file is truncated
+inline void read_or_error(std::ifstream& file, fs::path const& path, void * out, size_t size) {
+    file.read((char*)out, size);
+    if (!file || size_t(file.gcount()) != size) {
+        std::cerr << "Could not read " << size << " bytes from " << path << ", the file is truncated or unreadable" << std::endl;
+        std::exit(1);
+    }
+}
+
+inline uint32_t read32be(std::ifstream& ifile, fs::path const& path) {
     uint8_t bytes[4];
-    ifile.read((char*)bytes, sizeof(bytes));
+    read_or_error(ifile, path, bytes, sizeof(bytes));
     return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | ((uint32_t)bytes[3]);
 }
 
-inline Data data(fs::path directory) {
-    Images train, test;
-    
-    {
-        std::ifstream training_labels(directory / "train-labels-idx1-ubyte", std::fstream::binary);
-        if (uint32_t mn = read32be(training_labels); mn != 0x801) {
-            std::cerr << "Invalid magic number: " << mn << std::endl;
-            std::exit(1);
-        }
-        uint32_t const amount = read32be(training_labels);
-        std::vector<uint8_t> raw_labels(amount);
-        training_labels.read((char*)raw_labels.data(), amount);
-
-        train.labels.resize(amount);
-        for (size_t i = 0; i < amount; ++i) {
-            train.labels[i].resize(10);
-            train.labels[i][raw_labels[i]] = 1.0;
-        }
+inline std::ifstream open_idx(fs::path const& path, uint32_t magic) {
+    std::ifstream file(path, std::fstream::binary);
+    if (!file) {
+        std::cerr << "Could not open " << path << std::endl;
+        std::exit(1);
     }
+    if (uint32_t mn = read32be(file, path); mn != magic) {
+        std::cerr << "Invalid magic number in " << path << ": " << mn << std::endl;
+        std::exit(1);
+    }
+    return file;
+}
 
-    {
-        std::ifstream training_images(directory / "train-images-idx3-ubyte", std::fstream::binary);
-        if (uint32_t mn = read32be(training_images); mn != 0x803) {
-            std::cerr << "Invalid magic number: " << mn << std::endl;
+inline std::vector<uint8_t> read_idx_labels(fs::path const& path) {
+    std::ifstream file = open_idx(path, 0x801);
+    uint32_t const amount = read32be(file, path);
+    std::vector<uint8_t> labels(amount);
+    read_or_error(file, path, labels.data(), amount);
+    for (size_t i = 0; i < labels.size(); ++i) {
+        if (labels[i] >= NCLASSES) {
+            std::cerr << "Invalid label " << int(labels[i]) << " of sample " << i << " in " << path << std::endl;
             std::exit(1);
         }
-        uint32_t const amount = read32be(training_images);
-        uint32_t const rows = read32be(training_images);
-        uint32_t const columns = read32be(training_images);
-        uint32_t const n = rows * columns * amount;
-        std::vector<uint8_t> raw_pixels(n);
-        training_images.read((char*)raw_pixels.data(), n);
-
-        train.images.resize(amount);
-        for (size_t i = 0; i < amount; ++i) {
-            train.images[i].resize(rows * columns);
-            for (size_t j = 0; j < rows * columns; ++j) {
-                train.images[i][j] = raw_pixels[i * rows * columns + j] / 255.0;
+    }
+    return labels;
+}
+
+// Returns the pixels of amount images
+inline std::vector<uint8_t> read_idx_images(fs::path const& path, uint32_t& amount, uint32_t& rows, uint32_t& columns) {
+    std::ifstream file = open_idx(path, 0x803);
+    amount = read32be(file, path);
+    rows = read32be(file, path);
+    columns = read32be(file, path);
+    std::vector<uint8_t> pixels(size_t(amount) * rows * columns);
+    read_or_error(file, path, pixels.data(), pixels.size());
+    return pixels;
+}
+
+// Builds the whole cache file in memory
+inline std::vector<uint8_t> build_cache(fs::path const& directory) {
+    uint32_t ntrain, rows, columns, ntest, test_rows, test_columns;
+    std::vector<uint8_t> const train_labels = read_idx_labels(directory / "train-labels-idx1-ubyte");
+    std::vector<uint8_t> const train_pixels = read_idx_images(directory / "train-images-idx3-ubyte", ntrain, rows, columns);
+    std::vector<uint8_t> const test_labels = read_idx_labels(directory / "t10k-labels-idx1-ubyte");
+    std::vector<uint8_t> const test_pixels = read_idx_images(directory / "t10k-images-idx3-ubyte", ntest, test_rows, test_columns);
+    if (rows != test_rows || columns != test_columns) {
+        std::cerr << "Train and test images differ in size" << std::endl;
+        std::exit(1);
+    }
+    if (train_labels.size() != ntrain || test_labels.size() != ntest) {
+        std::cerr << "The label files don't match the image files: " << train_labels.size() << " labels for " << ntrain
+                  << " training images, " << test_labels.size() << " labels for " << ntest << " test images" << std::endl;
+        std::exit(1);
+    }
+
+    CacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.format = uint32_t(CacheFormat::U8);
+    header.scale = 1.0 / 255.0;
+    header.rows = rows;
+    header.columns = columns;
+    header.ntrain = train_labels.size();
+    header.ntest = test_labels.size();
+    header.train_pixels = cache_align(sizeof(CacheHeader));
+    header.train_labels = cache_align(header.train_pixels + train_pixels.size());
+    header.test_pixels = cache_align(header.train_labels + train_labels.size());
+    header.test_labels = cache_align(header.test_pixels + test_pixels.size());
+    header.size = header.test_labels + test_labels.size();
+
+    std::vector<uint8_t> cache(header.size);
+    memcpy(cache.data(), &header, sizeof(header));
+    std::copy(train_pixels.begin(), train_pixels.end(), &cache[header.train_pixels]);
+    std::copy(test_pixels.begin(), test_pixels.end(), &cache[header.test_pixels]);
+    std::copy(train_labels.begin(), train_labels.end(), &cache[header.train_labels]);
+    std::copy(test_labels.begin(), test_labels.end(), &cache[header.test_labels]);
+    return cache;
+}
+
+// Points the views into a complete cache file, or returns false if it isn't one this version understands
+inline bool read_cache(uint8_t const * bytes, size_t size, Data& data) {
+    CacheHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION ||
+        header.format != uint32_t(CacheFormat::U8) || header.size != size) {
+        return false;
+    }
+    size_t const isize = size_t(header.rows) * header.columns;
+    if (header.train_pixels + header.ntrain * isize > size || header.train_labels + header.ntrain > size ||
+        header.test_pixels + header.ntest * isize > size || header.test_labels + header.ntest > size) {
+        return false;
+    }
+
+    data.train = {
+        .count = header.ntrain,
+        .rows = header.rows,
+        .columns = header.columns,
+        .pixels = bytes + header.train_pixels,
+        .labels = bytes + header.train_labels,
+        .scale = header.scale,
+    };
+    data.test = {
+        .count = header.ntest,
+        .rows = header.rows,
+        .columns = header.columns,
+        .pixels = bytes + header.test_pixels,
+        .labels = bytes + header.test_labels,
+        .scale = header.scale,
+    };
+    return true;
+}
+
+// Maps the cache file read only, or returns nullptr if it can't be
+inline std::shared_ptr<void const> map_file(fs::path const& path, size_t& size) {
+    int const fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = st.st_size;
+    void * const mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return nullptr;
+    return std::shared_ptr<void const>(mapping, [size](void const * p){ munmap(const_cast<void*>(p), size); });
+}
+
+// The cache is stale once any of the IDX files is newer
+inline bool cache_is_fresh(fs::path const& directory, fs::path const& cache) {
+    std::error_code ec;
+    auto const cache_time = fs::last_write_time(cache, ec);
+    if (ec) return false;
+    for (char const * name : {"train-labels-idx1-ubyte", "train-images-idx3-ubyte", "t10k-labels-idx1-ubyte", "t10k-images-idx3-ubyte"}) {
+        auto const idx_time = fs::last_write_time(directory / name, ec);
+        if (!ec && idx_time > cache_time) return false;
+    }
+    return true;
+}
+
+inline Data data(fs::path directory) {
+    fs::path const cache_path = directory / "mnist.cache";
+    Data result;
+
+    if (cache_is_fresh(directory, cache_path)) {
+        size_t size = 0;
+        if (auto mapping = map_file(cache_path, size)) {
+            if (read_cache((uint8_t const *)mapping.get(), size, result)) {
+                result.storage = std::move(mapping);
+                return result;
             }
         }
     }
-    
+
+    std::cout << "Building dataset cache " << cache_path << std::endl;
+    auto cache = std::make_shared<std::vector<uint8_t>>(build_cache(directory));
+
+    // Written under a temporary name first, so a concurrent run never maps a half written file
+    fs::path const tmp_path = cache_path.string() + ".tmp" + std::to_string(getpid());
+    bool written;
     {
-        std::ifstream test_labels(directory / "t10k-labels-idx1-ubyte", std::fstream::binary);
-        if (uint32_t mn = read32be(test_labels); mn != 0x801) {
-            std::cerr << "Invalid magic number: " << mn << std::endl;
-            std::exit(1);
-        }
-        uint32_t const amount = read32be(test_labels);
-        std::vector<uint8_t> raw_labels(amount);
-        test_labels.read((char*)raw_labels.data(), amount);
-
-        test.labels.resize(amount);
-        for (size_t i = 0; i < amount; ++i) {
-            test.labels[i].resize(10);
-            test.labels[i][raw_labels[i]] = 1.0;
-        }
+        std::ofstream out(tmp_path, std::fstream::binary);
+        out.write((char const *)cache->data(), cache->size());
+        written = bool(out);
+    }
+    std::error_code ec;
+    if (written) fs::rename(tmp_path, cache_path, ec);
+    if (!written || ec) {
+        std::cerr << "Could not write the dataset cache, continuing without it" << std::endl;
+        fs::remove(tmp_path, ec);
     }
 
-    {
-        std::ifstream test_images(directory / "t10k-images-idx3-ubyte", std::fstream::binary);
-        if (uint32_t mn = read32be(test_images); mn != 0x803) {
-            std::cerr << "Invalid magic number: " << mn << std::endl;
-            std::exit(1);
-        }
-        uint32_t const amount = read32be(test_images);
-        uint32_t const rows = read32be(test_images);
-        uint32_t const columns = read32be(test_images);
-        uint32_t const n = rows * columns * amount;
-        std::vector<uint8_t> raw_pixels(n);
-        test_images.read((char*)raw_pixels.data(), n);
-
-        test.images.resize(amount);
-        for (size_t i = 0; i < amount; ++i) {
-            test.images[i].resize(rows * columns);
-            for (size_t j = 0; j < rows * columns; ++j) {
-                test.images[i][j] = raw_pixels[i * rows * columns + j] / 255.0;
-            }
-        }
+    size_t size = 0;
+    if (auto mapping = map_file(cache_path, size); mapping && read_cache((uint8_t const *)mapping.get(), size, result)) {
+        result.storage = std::move(mapping);
+        return result;
     }
 
-    return {.test=test, .train=train};
+    // Not writable, use the in memory copy
+    read_cache(cache->data(), cache->size(), result);
+    result.storage = std::move(cache);
+    return result;
 }
 
 namespace std {
 inline ostream& operator<<(ostream& os, Images const& images) {
-    os << "Nlabels: " << images.labels.size() << " Nimages: " << images.images.size() << std::endl;
+    os << "Nimages: " << images.size() << " (" << images.rows << "x" << images.columns << ")" << std::endl;
     return os;
 }
 }
-
@@ -0,0 +1,160 @@
+#pragma once
+#include "data.hpp"
+#include "neuralnetwork.hpp"
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <optional>
+
+// Evaluates snapshots of a network's parameters on a whole dataset, on its own thread.
+// submit only copies the parameters into a pending buffer and returns, so training never waits for an evaluation.
+// When snapshots arrive faster than they can be evaluated, the evaluator skips to the newest one.
+template <class T>
+struct EvaluatorT {
+  using Confusion = std::array<std::array<size_t, NCLASSES>, NCLASSES>; // confusion[label][guess]
+
+  struct Result {
+    size_t step;
+    double accuracy;
+    double loss; // Mean over the images
+    Confusion confusion;
+  };
+
+  // Classifies images [begin, end) as one batch, normalized into xs, adds every guess to confusion and returns the
+  // summed loss. Only writes its arguments, so threads with their own can share nn.
+  static double tally(NeuralNetworkT<T> const& nn, Images const& images, size_t begin, size_t end, VecT<T>& xs,
+                      typename NeuralNetworkT<T>::InferenceContext& context, Confusion& confusion) {
+    size_t const n = end - begin;
+    size_t const isize = images.image_size();
+    xs.elements.resize(n * isize);
+    for (size_t i = 0; i < n; ++i) {
+      images.normalize(begin + i, &xs[i * isize]);
+    }
+
+    VecT<T> const& output = nn.evaluate_batch(xs, n, context);
+    for (size_t i = 0; i < n; ++i) {
+      auto const first = output.elements.begin() + i*NCLASSES;
+      size_t const guess = std::max_element(first, first + NCLASSES) - first;
+      ++confusion[images.label(begin + i)][guess];
+    }
+    return SoftmaxCrossEntropyT<T>::loss_batch(output, images.labels + begin, n);
+  }
+
+  // The images on the diagonal
+  static size_t correct(Confusion const& confusion) {
+    size_t result = 0;
+    for (size_t label = 0; label < NCLASSES; ++label) {
+      result += confusion[label][label];
+    }
+    return result;
+  }
+
+  // make builds the network the snapshots are loaded into, it must have the same architecture as the trained one
+  EvaluatorT(Images const& images, std::function<NeuralNetworkT<T>()> const& make): images{images}, nn{make()} {
+    this->pending.resize(this->nn.params.size());
+    this->thread = std::thread([this](){ this->work(); });
+  }
+
+  EvaluatorT(EvaluatorT const&) = delete;
+  EvaluatorT& operator=(EvaluatorT const&) = delete;
+
+  ~EvaluatorT() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->changed.notify_all();
+    this->thread.join();
+  }
+
+  // Queues a copy of params, taken after step training steps
+  void submit(size_t step, AlignedVector<T> const& params) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      std::copy(params.begin(), params.end(), this->pending.begin());
+      this->pending_step = step;
+      this->has_pending = true;
+    }
+    this->changed.notify_all();
+  }
+
+  // The newest result not returned before, if there is one
+  std::optional<Result> poll() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->has_result) return std::nullopt;
+    this->has_result = false;
+    return this->result;
+  }
+
+  // Blocks until every submitted snapshot is evaluated and returns the newest result
+  std::optional<Result> wait() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [this](){ return !this->has_pending && !this->busy; });
+    if (!this->has_result) return std::nullopt;
+    this->has_result = false;
+    return this->result;
+  }
+
+  private:
+  Images const& images;
+  NeuralNetworkT<T> nn; // Only used by the evaluator thread
+  typename NeuralNetworkT<T>::InferenceContext context;
+  VecT<T> xs;
+
+  AlignedVector<T> pending;
+  size_t pending_step = 0;
+  bool has_pending = false;
+  bool busy = false;
+  Result result = {};
+  bool has_result = false;
+  bool stopping = false;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread thread;
+
+  void work() {
+    profiler::name_thread("evaluator");
+    while (true) {
+      size_t step;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this](){ return this->stopping || this->has_pending; });
+        if (this->stopping) return;
+        std::copy(this->pending.begin(), this->pending.end(), this->nn.params.begin());
+        step = this->pending_step;
+        this->has_pending = false;
+        this->busy = true;
+      }
+      this->nn.params_changed();
+
+      Result const evaluated = [&](){
+        profiler::Scope scope("snapshot", "evaluate");
+        return this->evaluate(step);
+      }();
+
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->result = evaluated;
+        this->has_result = true;
+        this->busy = false;
+      }
+      this->changed.notify_all();
+    }
+  }
+
+  Result evaluate(size_t step) {
+    size_t const BATCH_SIZE = 100;
+
+    Result r = {};
+    r.step = step;
+    for (size_t start = 0; start < this->images.size(); start += BATCH_SIZE) {
+      size_t const end = std::min(start + BATCH_SIZE, this->images.size());
+      r.loss += tally(this->nn, this->images, start, end, this->xs, this->context, r.confusion);
+    }
+    r.accuracy = double(correct(r.confusion)) / this->images.size();
+    r.loss /= this->images.size();
+    return r;
+  }
+};
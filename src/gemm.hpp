@@ -0,0 +1,167 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <stddef.h>
+#include "simd.hpp"
+
+// Cache-blocked matrix multiplication C += A * B.
+// Every operand is addressed through a row and a column stride, so transposed operands don't need a copy:
+// element (i, j) of A lives at a[i*ars + j*acs].
+//
+// The loops follow the usual GotoBLAS structure: a KC x NC block of B and an MC x KC block of A are packed into
+// contiguous panels (sized to stay in L2 and L1 respectively), after which a MR x NR register tile of C is
+// accumulated by the micro kernel, which is dispatched on the CPU's instruction set like the simd kernels.
+namespace gemm {
+
+// A row of the register tile is 64 bytes: 8 doubles or 16 floats
+constexpr size_t MR = 4;
+template <class T> constexpr size_t NR = 64 / sizeof(T);
+constexpr size_t MC = 64;
+constexpr size_t KC = 256;
+constexpr size_t NC = 2048;
+
+// Packs the mc x kc block of A into MR row slivers, each stored column by column. Missing rows are zero.
+template <class T>
+inline void pack_a(size_t mc, size_t kc, T const * a, size_t ars, size_t acs, T * packed) {
+  for (size_t i = 0; i < mc; i += MR) {
+    size_t const mr = std::min(MR, mc - i);
+    for (size_t p = 0; p < kc; ++p) {
+      for (size_t ii = 0; ii < MR; ++ii) {
+        *packed++ = ii < mr ? a[(i + ii)*ars + p*acs] : T(0);
+      }
+    }
+  }
+}
+
+// Packs the kc x nc block of B into NR column slivers, each stored row by row. Missing columns are zero.
+template <class T>
+inline void pack_b(size_t kc, size_t nc, T const * b, size_t brs, size_t bcs, T * packed) {
+  for (size_t j = 0; j < nc; j += NR<T>) {
+    size_t const nr = std::min(NR<T>, nc - j);
+    for (size_t p = 0; p < kc; ++p) {
+      for (size_t jj = 0; jj < NR<T>; ++jj) {
+        *packed++ = jj < nr ? b[p*brs + (j + jj)*bcs] : T(0);
+      }
+    }
+  }
+}
+
+// C[0:mr, 0:nr] += A sliver * B sliver
+template <class T>
+inline void micro_kernel(size_t kc, T const * a, T const * b, T * c, size_t ldc, size_t mr, size_t nr) {
+  T acc[MR][NR<T>] = {};
+  for (size_t p = 0; p < kc; ++p) {
+    for (size_t i = 0; i < MR; ++i) {
+      for (size_t j = 0; j < NR<T>; ++j) {
+        acc[i][j] += a[p*MR + i] * b[p*NR<T> + j];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < mr; ++i) {
+    for (size_t j = 0; j < nr; ++j) {
+      c[i*ldc + j] += acc[i][j];
+    }
+  }
+}
+
+// Same as micro_kernel, but every row of the register tile is held in 64/BYTES explicit vectors
+template <class T, size_t BYTES>
+SIMD_INLINE void micro_kernel_vector(size_t kc, T const * a, T const * b, T * c, size_t ldc, size_t mr, size_t nr) {
+  using V = typename simd::Vector<T, BYTES>::type;
+  constexpr size_t N = BYTES / sizeof(T);
+  constexpr size_t NV = NR<T> / N;
+
+  V acc[MR][NV] = {};
+  for (size_t p = 0; p < kc; ++p) {
+    V bv[NV];
+    for (size_t v = 0; v < NV; ++v) {
+      memcpy(&bv[v], b + p*NR<T> + v*N, BYTES);
+    }
+    for (size_t i = 0; i < MR; ++i) {
+      for (size_t v = 0; v < NV; ++v) {
+        acc[i][v] += a[p*MR + i] * bv[v];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < mr; ++i) {
+    if (nr == NR<T>) {
+      for (size_t v = 0; v < NV; ++v) {
+        V cv;
+        memcpy(&cv, c + i*ldc + v*N, BYTES);
+        cv += acc[i][v];
+        memcpy(c + i*ldc + v*N, &cv, BYTES);
+      }
+    } else {
+      T tile[NR<T>];
+      memcpy(tile, acc[i], sizeof(tile));
+      for (size_t j = 0; j < nr; ++j) {
+        c[i*ldc + j] += tile[j];
+      }
+    }
+  }
+}
+
+template <class T>
+using MicroKernel = void (*)(size_t, T const *, T const *, T *, size_t, size_t, size_t);
+
+#if defined(__x86_64__) || defined(__i386__)
+template <class T>
+__attribute__((target("sse2"))) void micro_kernel_sse2(size_t kc, T const * a, T const * b, T * c, size_t ldc, size_t mr, size_t nr) {
+  micro_kernel_vector<T, 16>(kc, a, b, c, ldc, mr, nr);
+}
+template <class T>
+__attribute__((target("avx2,fma"))) void micro_kernel_avx2(size_t kc, T const * a, T const * b, T * c, size_t ldc, size_t mr, size_t nr) {
+  micro_kernel_vector<T, 32>(kc, a, b, c, ldc, mr, nr);
+}
+template <class T>
+__attribute__((target("avx512f"))) void micro_kernel_avx512(size_t kc, T const * a, T const * b, T * c, size_t ldc, size_t mr, size_t nr) {
+  micro_kernel_vector<T, 64>(kc, a, b, c, ldc, mr, nr);
+}
+#endif
+
+template <class T>
+inline MicroKernel<T> micro_kernel_for(simd::Level level) {
+  switch (level) {
+#if defined(__x86_64__) || defined(__i386__)
+    case simd::Level::AVX512: return micro_kernel_avx512<T>;
+    case simd::Level::AVX2: return micro_kernel_avx2<T>;
+    case simd::Level::SSE2: return micro_kernel_sse2<T>;
+#endif
+    default: return micro_kernel<T>;
+  }
+}
+
+// C (m x n, row major with leading dimension ldc) += A (m x k) * B (k x n)
+template <class T>
+inline void gemm(size_t m, size_t n, size_t k,
+                 T const * a, size_t ars, size_t acs,
+                 T const * b, size_t brs, size_t bcs,
+                 T * c, size_t ldc) {
+  static MicroKernel<T> const kernel = micro_kernel_for<T>(simd::level());
+  thread_local std::vector<T> apack(MC * KC);
+  thread_local std::vector<T> bpack(KC * (NC + NR<T>));
+
+  for (size_t jc = 0; jc < n; jc += NC) {
+    size_t const nc = std::min(NC, n - jc);
+    for (size_t pc = 0; pc < k; pc += KC) {
+      size_t const kc = std::min(KC, k - pc);
+      pack_b(kc, nc, b + pc*brs + jc*bcs, brs, bcs, bpack.data());
+
+      for (size_t ic = 0; ic < m; ic += MC) {
+        size_t const mc = std::min(MC, m - ic);
+        pack_a(mc, kc, a + ic*ars + pc*acs, ars, acs, apack.data());
+
+        for (size_t jr = 0; jr < nc; jr += NR<T>) {
+          for (size_t ir = 0; ir < mc; ir += MR) {
+            kernel(kc, &apack[ir*kc], &bpack[jr*kc], &c[(ic + ir)*ldc + jc + jr], ldc,
+                   std::min(MR, mc - ir), std::min(NR<T>, nc - jr));
+          }
+        }
+      }
+    }
+  }
+}
+
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <stddef.h>
+
+// A series of values that never holds more than capacity buckets, however many values are pushed.
+// Every bucket summarizes width consecutive values by their min, max and mean. Once all the buckets are full,
+// neighbouring pairs are merged and width doubles, so older and newer values always have the same resolution.
+// The extrema over all values are kept on the side, so none of the queries depend on how long the series is.
+struct History {
+  struct Bucket {
+    float min;
+    float max;
+    double sum;
+    size_t count;
+
+    float mean() const {
+      return this->sum / this->count;
+    }
+  };
+
+  explicit History(size_t capacity = 1024): capacity{std::max<size_t>(capacity, 2) / 2 * 2} {
+    this->buckets.reserve(this->capacity);
+  }
+
+  void push(float value) {
+    this->lowest = std::min(this->lowest, value);
+    this->highest = std::max(this->highest, value);
+    ++this->count;
+
+    if (this->buckets.empty() || this->buckets.back().count == this->width) {
+      if (this->buckets.size() == this->capacity) {
+        this->halve();
+      }
+      this->buckets.push_back({.min = value, .max = value, .sum = 0, .count = 0});
+    }
+
+    Bucket& bucket = this->buckets.back();
+    bucket.min = std::min(bucket.min, value);
+    bucket.max = std::max(bucket.max, value);
+    bucket.sum += value;
+    ++bucket.count;
+  }
+
+  bool empty() const {
+    return this->count == 0;
+  }
+
+  // The number of values pushed so far
+  size_t size() const {
+    return this->count;
+  }
+
+  float min() const {
+    return this->lowest;
+  }
+
+  float max() const {
+    return this->highest;
+  }
+
+  std::vector<Bucket> const& summary() const {
+    return this->buckets;
+  }
+
+  private:
+  size_t capacity;
+  size_t width = 1; // Values per full bucket
+  size_t count = 0;
+  float lowest = std::numeric_limits<float>::infinity();
+  float highest = -std::numeric_limits<float>::infinity();
+  std::vector<Bucket> buckets;
+
+  void halve() {
+    for (size_t i = 0; i < this->buckets.size() / 2; ++i) {
+      Bucket const& l = this->buckets[2*i];
+      Bucket const& r = this->buckets[2*i + 1];
+      this->buckets[i] = {
+        .min = std::min(l.min, r.min),
+        .max = std::max(l.max, r.max),
+        .sum = l.sum + r.sum,
+        .count = l.count + r.count,
+      };
+    }
+    this->buckets.resize(this->buckets.size() / 2);
+    this->width *= 2;
+  }
+};
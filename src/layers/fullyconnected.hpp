@@ -1,64 +1,85 @@
 #pragma once
 #include "layers/layer.hpp"
+#include "gemm.hpp"
 #include <cmath>
+#include <algorithm>
 
-struct FullyConnected : public Layer {
+template <class T>
+struct FullyConnectedT : public LayerT<T> {
   size_t ninputs;
   size_t nneurons;
 
-  Matrix weights;
-  Vec biases;
+  FullyConnectedT(size_t ninputs, size_t nneurons): ninputs{ninputs}, nneurons{nneurons} { };
 
-  FullyConnected(size_t ninputs, size_t nneurons): ninputs{ninputs}, nneurons{nneurons}, weights{nneurons, ninputs}, biases{nneurons} { };
+  // A nneurons x ninputs weight matrix, followed by the biases
+  virtual size_t nparams() const override {
+    return this->nneurons * this->ninputs + this->nneurons;
+  }
 
+  T const * weights() const {
+    return this->params;
+  }
 
-  virtual void dump_weights(std::ostream& out) const override {
-      out.write((char const*)this->weights.elements.data(), this->weights.elements.size()*(sizeof (decltype(this->weights.elements)::value_type)));
-      out.write((char const*)this->biases.elements.data(), this->biases.elements.size()*(sizeof (decltype(this->biases.elements)::value_type)));
+  T const * biases() const {
+    return this->params + this->nneurons * this->ninputs;
   }
-  
-  virtual void load_weights(std::istream& in) override {
-      in.read((char *)this->weights.elements.data(), this->weights.elements.size()*(sizeof (decltype(this->weights.elements)::value_type)));
-      in.read((char *)this->biases.elements.data(), this->biases.elements.size()*(sizeof (decltype(this->biases.elements)::value_type)));
+
+  using typename LayerT<T>::Cache;
+
+  // The biases are copied into Y, not added
+  virtual profiler::Cost forward_cost(size_t xsize) const override {
+    double const n = xsize / this->ninputs;
+    return {
+      .flops = 2 * n * this->ninputs * this->nneurons,
+      .bytes = sizeof(T) * (xsize + n * this->nneurons + this->nparams()),
+    };
   }
 
-  virtual void initialize(std::function<double(void)>& d) override {
-    this->weights.initialize(d);
-    this->biases.initialize(d);
+  // Two products of the forward's size, for dW and dx, and the bias sums
+  virtual profiler::Cost backward_cost(size_t xsize) const override {
+    double const n = xsize / this->ninputs;
+    return {
+      .flops = n * this->nneurons * (4 * this->ninputs + 1),
+      .bytes = sizeof(T) * (2*xsize + n * this->nneurons + 3*this->nparams()),
+    };
   }
 
-  virtual Gradient grad(Vec const& uppergrad) override {
-    Vec dw(this->weights.size() + this->biases.size());
-    size_t dwidx = 0;
-    // Weights part
-    for (size_t ri = 0; ri < this->weights.rows; ++ri) {
-      for (size_t ci = 0; ci < this->weights.columns; ++ci) {
-        dw[dwidx] = this->x[ci] * uppergrad[ri];
-        ++dwidx;
-      }
-    }
+  private:
+  virtual void grad_batch(VecT<T> const& uppergrad, Cache const& cache, T * dw, VecT<T>& dx, Workspace&) const override {
+    dx.elements.assign(this->ninputs * cache.n, T(0));
+
+    // dW (nneurons x ninputs) += G^T X, summed over the batch
+    gemm::gemm(this->nneurons, this->ninputs, cache.n,
+               uppergrad.elements.data(), 1, this->nneurons,
+               cache.x.data(), this->ninputs, 1,
+               dw, this->ninputs);
+
     // Biases part
-    for (size_t i = 0; i < this->biases.size(); ++i) {
-      dw[dwidx] = uppergrad[i];
-      ++dwidx;
+    T * const db = dw + this->nneurons * this->ninputs;
+    for (size_t sample = 0; sample < cache.n; ++sample) {
+      simd::kernels<T>().add(db, &uppergrad[sample * this->nneurons], db, this->nneurons);
     }
 
-    Vec const dx = grad_mat_mul(uppergrad, this->weights);
-
-    return {
-      .dx = dx,
-      .dw = dw
-    };
+    // dX (n x ninputs) = G W
+    gemm::gemm(cache.n, this->ninputs, this->nneurons,
+               uppergrad.elements.data(), this->nneurons, 1,
+               this->weights(), this->ninputs, 1,
+               dx.elements.data(), this->ninputs);
   };
 
-  virtual void adjust_weights(Vec const& wsandbs) override {
-    this->weights.add_as_vec(wsandbs.slice_n(0, this->weights.size()));
-    this->biases = this->biases + wsandbs.slice_n(this->weights.size(), this->biases.size());
-  }
+  // Y (n x nneurons) = X W^T + b as one matrix-matrix product over the batch
+  virtual void eval_batch(VecViewT<T> x, size_t n, VecT<T>& y, Workspace&) const override {
+    y.elements.resize(this->nneurons * n);
+    for (size_t sample = 0; sample < n; ++sample) {
+      std::copy(this->biases(), this->biases() + this->nneurons, y.elements.begin() + sample * this->nneurons);
+    }
 
-  private:
-  virtual Vec eval(Vec const& x) override {
-    return this->weights * x + this->biases;
+    gemm::gemm(n, this->nneurons, this->ninputs,
+               x.data(), this->ninputs, 1,
+               this->weights(), 1, this->ninputs,
+               y.elements.data(), this->nneurons);
   }
 
 };
+
+using FullyConnected = FullyConnectedT<double>;
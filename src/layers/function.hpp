@@ -2,41 +2,55 @@
 #include "math.hpp"
 #include "layers/layer.hpp"
 
-inline double sigmoid(double x) {
-  return 1.0 / (1.0 + std::exp(-x));
+template <class T>
+inline T sigmoid(T x) {
+  return T(1) / (T(1) + std::exp(-x));
 }
 
-inline double dsigmoid(double x) {
-  double const emx = std::exp(-x);
-  return emx / ((1.0 + emx) * (1.0 + emx));
-}
+template <class T>
+struct SigmoidT : public LayerT<T> {
+  using typename LayerT<T>::Cache;
 
-struct Sigmoid : public Layer {
-  virtual Gradient grad(Vec const& uppergrad) override {
-    Vec dsx = this->x;
-    dsx.apply(dsigmoid);
-    
-    return {
-      .dx = hadamard_product(dsx, uppergrad),
-      .dw = Vec()
-    };
-  };
+  simd::Accuracy accuracy;
+
+  SigmoidT(simd::Accuracy accuracy = simd::Accuracy::Accurate): accuracy{accuracy} {}
 
-  virtual void adjust_weights(Vec const& wsandbs) override {
-    (void)wsandbs;
-    return;
+  // exp is counted as its polynomial plus the range reduction, whatever the accuracy: the same for Exact as for
+  // Accurate
+  virtual profiler::Cost forward_cost(size_t xsize) const override {
+    int const degree = this->accuracy == simd::Accuracy::Fast ? simd::body::FAST_DEGREE<T> : simd::body::ACCURATE_DEGREE<T>;
+    return {.flops = double(xsize) * (12 + 3*degree), .bytes = 2.0 * sizeof(T) * xsize};
   }
 
-  virtual void dump_weights(std::ostream&) const override {}
-  virtual void load_weights(std::istream&) override {}
-  virtual void initialize(std::function<double(void)>&) override {};
+  virtual profiler::Cost backward_cost(size_t xsize) const override {
+    return {.flops = 3.0 * xsize, .bytes = 3.0 * sizeof(T) * xsize};
+  }
 
   private:
-  virtual Vec eval(Vec const& x) override {
-    Vec y = x;
-    y.apply(sigmoid);
-    return y;
+  // s' = s * (1 - s), so the cached output is all it needs
+  virtual void grad_batch(VecT<T> const& uppergrad, Cache const& cache, T *, VecT<T>& dx, Workspace&) const override {
+    dx.elements.resize(uppergrad.size());
+    simd::kernels<T>().dsigmoid(cache.fx.elements.data(), uppergrad.elements.data(), dx.elements.data(), dx.size());
+  };
+
+  // Elementwise, so a batch is just a longer vector
+  virtual void eval_batch(VecViewT<T> x, size_t n, VecT<T>& y, Workspace&) const override {
+    (void)n;
+    y.elements.resize(x.size());
+    switch (this->accuracy) {
+      case simd::Accuracy::Exact:
+        std::copy(x.data(), x.data() + x.size(), y.elements.begin());
+        y.apply(sigmoid<T>);
+        break;
+      case simd::Accuracy::Accurate:
+        simd::kernels<T>().sigmoid(x.data(), y.elements.data(), y.size());
+        break;
+      case simd::Accuracy::Fast:
+        simd::kernels<T>().sigmoid_fast(x.data(), y.elements.data(), y.size());
+        break;
+    }
   }
 
 };
 
+using Sigmoid = SigmoidT<double>;
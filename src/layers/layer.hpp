@@ -1,30 +1,69 @@
 #pragma once
 #include "math.hpp"
+#include "profiler.hpp"
+#include "workspace.hpp"
 #include <functional>
 
-struct Layer {
-  struct Gradient {
-    Vec dx;
-    Vec dw;
-  }; 
+template <class T>
+struct LayerT {
+  // The forward_batch that grad_batch differentiates: views of its input and output. Layers store nothing, the
+  // network keeps the one buffer of every layer boundary, so threads training the same layer only need their own
+  // buffers.
+  struct Cache {
+    size_t n;
+    VecViewT<T> x;
+    VecT<T> const& fx;
+  };
 
-  Vec const& forward(Vec const& x) {
-    this->x = x;
-    this->fx = this->eval(x);
-    return this->fx;
+  char const * name = "layer"; // What the profiler files it under
+
+  // x holds n samples back to back, each laid out as C x H x W, and y gets the n outputs. Temporaries come from
+  // workspace and are given back before returning.
+  void forward_batch(VecViewT<T> x, size_t n, VecT<T>& y, Workspace& workspace) const {
+    Workspace::Frame const frame(workspace);
+    this->eval_batch(x, n, y, workspace);
+  }
+
+  // Gradient w.r.t. the forward_batch in cache: writes dx per sample and adds dw, summed over the batch, to the
+  // nparams() values at dw
+  void backward_batch(VecT<T> const& uppergrad, Cache const& cache, T * dw, VecT<T>& dx, Workspace& workspace) const {
+    Workspace::Frame const frame(workspace);
+    this->grad_batch(uppergrad, cache, dw, dx, workspace);
   }
 
-  virtual Gradient grad(Vec const&) = 0;
-  virtual void adjust_weights(Vec const&) = 0;
-  virtual void dump_weights(std::ostream&) const = 0;
-  virtual void load_weights(std::istream&) = 0;
-  virtual void initialize(std::function<double(void)>&) = 0;
+  // The most workspace, in bytes, that a forward or backward pass on n samples takes
+  virtual size_t workspace_size(size_t n) const {
+    (void)n;
+    return 0;
+  }
+
+  // The work of forward_batch and of grad_batch on an input of xsize elements, the whole batch. What the profiler
+  // divides by the measured time.
+  virtual profiler::Cost forward_cost(size_t xsize) const = 0;
+  virtual profiler::Cost backward_cost(size_t xsize) const = 0;
 
-  Layer() : x{}, fx{} {};
+  // The trainable parameters live in the network's arena, the layer only gets a view of its nparams() values
+  virtual size_t nparams() const {
+    return 0;
+  }
+
+  void bind(T * params) {
+    this->params = params;
+  }
+
+  // The network calls this whenever the parameters changed, for layers that also keep them in another layout.
+  // Never during a batch, so the layouts can be read by every thread without locks.
+  virtual void params_changed() {}
+
+  LayerT() = default;
+  virtual ~LayerT() = default;
 
   protected:
-  Vec x;
-  Vec fx;
+  T * params = nullptr;
 
-  virtual Vec eval(Vec const&) = 0;
+  // Both resize their output, which keeps its capacity, and can take temporaries from workspace
+  virtual void eval_batch(VecViewT<T> x, size_t n, VecT<T>& y, Workspace& workspace) const = 0;
+  virtual void grad_batch(VecT<T> const& uppergrad, Cache const& cache, T * dw, VecT<T>& dx, Workspace& workspace) const = 0;
 };
+
+using Layer = LayerT<double>;
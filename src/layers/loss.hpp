@@ -0,0 +1,51 @@
+#pragma once
+#include "math.hpp"
+#include <cmath>
+#include <stdint.h>
+
+// The output stage of the network: softmax followed by the cross entropy against integer class labels, fused.
+// Each row of logits z gives loss = log(sum(exp(z))) - z[label], computed with the row's maximum subtracted first so
+// exp never overflows, and the gradient w.r.t. the logits is softmax(z) - onehot(label).
+template <class T>
+struct SoftmaxCrossEntropyT {
+  // The summed loss of the n rows of logits
+  static double loss_batch(VecT<T> const& logits, uint8_t const * labels, size_t n) {
+    size_t const classes = logits.size() / n;
+    double loss = 0;
+    for (size_t sample = 0; sample < n; ++sample) {
+      T const * const z = &logits[sample * classes];
+      T const max = *std::max_element(z, z + classes);
+      T sum = 0;
+      for (size_t i = 0; i < classes; ++i) {
+        sum += std::exp(z[i] - max);
+      }
+      loss += double(max + std::log(sum) - z[labels[sample]]);
+    }
+    return loss;
+  }
+
+  // Same as loss_batch, but also writes the gradient w.r.t. the logits to dlogits
+  static double grad_batch(VecT<T> const& logits, uint8_t const * labels, size_t n, VecT<T>& dlogits) {
+    size_t const classes = logits.size() / n;
+    dlogits.elements.assign(logits.elements.begin(), logits.elements.end());
+    double loss = 0;
+    for (size_t sample = 0; sample < n; ++sample) {
+      T * const z = &dlogits[sample * classes];
+      T const max = *std::max_element(z, z + classes);
+      T const zlabel = z[labels[sample]];
+      T sum = 0;
+      for (size_t i = 0; i < classes; ++i) {
+        z[i] = std::exp(z[i] - max);
+        sum += z[i];
+      }
+      loss += double(max + std::log(sum) - zlabel);
+
+      T const inv = T(1) / sum;
+      for (size_t i = 0; i < classes; ++i) {
+        z[i] *= inv;
+      }
+      z[labels[sample]] -= T(1);
+    }
+    return loss;
+  }
+};
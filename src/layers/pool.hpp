@@ -2,16 +2,32 @@
 #include "math.hpp"
 #include "layers/layer.hpp"
 
-struct AveragePooling : public Layer {
+template <class T>
+struct AveragePoolingT : public LayerT<T> {
   size_t iheight;
   size_t iwidth;
   
   size_t pheight;
   size_t pwidth;
 
-  AveragePooling(size_t ih, size_t iw, size_t ph, size_t pw): iheight{ih}, iwidth{iw}, pheight{ph}, pwidth{pw} {};
+  AveragePoolingT(size_t ih, size_t iw, size_t ph, size_t pw): iheight{ih}, iwidth{iw}, pheight{ph}, pwidth{pw} {};
 
-  virtual Gradient grad(Vec const& uppergrad) override {
+  using typename LayerT<T>::Cache;
+
+  // A sum over the window and a scale per output
+  virtual profiler::Cost forward_cost(size_t xsize) const override {
+    double const nout = xsize / (this->pheight * this->pwidth);
+    return {.flops = xsize + nout, .bytes = sizeof(T) * (xsize + nout)};
+  }
+
+  // A scale per input
+  virtual profiler::Cost backward_cost(size_t xsize) const override {
+    double const nout = xsize / (this->pheight * this->pwidth);
+    return {.flops = double(xsize), .bytes = sizeof(T) * (xsize + nout)};
+  }
+
+  private:
+  virtual void grad_batch(VecT<T> const& uppergrad, Cache const&, T *, VecT<T>& dx, Workspace&) const override {
     size_t const owidth = iwidth / pwidth;
     size_t const oheight = iheight / pheight;
     size_t const pchannels = uppergrad.size() / (owidth * oheight);
@@ -20,9 +36,9 @@ struct AveragePooling : public Layer {
     size_t const isize = iwidth * iheight;
     size_t const osize = owidth*oheight;
     size_t const nin = isize*pchannels;
-    double const Ninv = 1. / psize;
+    T const Ninv = T(1) / psize;
     
-    Vec dx(nin);
+    dx.elements.assign(nin, T(0));
     for (size_t ichannel = 0; ichannel < pchannels; ++ichannel) {
       for (size_t orow = 0; orow < oheight; ++orow) {
         for (size_t ocol = 0; ocol < owidth; ++ocol) {
@@ -36,24 +52,12 @@ struct AveragePooling : public Layer {
         }
       }
     }
-
-    return {
-      .dx = dx,
-      .dw = Vec()
-    };
   };
 
-  virtual void dump_weights(std::ostream&) const override {}
-  virtual void load_weights(std::istream&) override {}
-
-  virtual void adjust_weights(Vec const& wsandbs) override {
-    (void)wsandbs;
-    return;
-  }
-
-  private:
-  virtual Vec eval(Vec const& x) override {
+  virtual void eval_batch(VecViewT<T> x, size_t n, VecT<T>& y, Workspace&) const override {
+    (void)n;
     size_t const isize = iwidth * iheight;
+    // Every channel of every sample is pooled the same way
     size_t const pchannels = x.size() / isize;
     size_t const owidth = iwidth / pwidth;
     size_t const oheight = iheight / pheight;
@@ -61,14 +65,14 @@ struct AveragePooling : public Layer {
     size_t const psize = pwidth * pheight;
     size_t const osize = owidth*oheight;
     size_t const nout = osize*pchannels;
-    double const Ninv = 1. / psize;
+    T const Ninv = T(1) / psize;
 
-    Vec y(nout);
+    y.elements.resize(nout);
     for (size_t ichannel = 0; ichannel < pchannels; ++ichannel) {
       for (size_t orow = 0; orow < oheight; ++orow) {
         for (size_t ocol = 0; ocol < owidth; ++ocol) {
           // Loop over the filter window
-          double acc = 0;
+          T acc = 0;
           for (size_t prow = 0; prow < pheight; ++prow) {
             for (size_t pcol = 0; pcol < pwidth; ++pcol) {
               size_t const iidx = (orow*pheight + prow)*iwidth + (ocol*pwidth + pcol); // Index within the channel
@@ -79,11 +83,7 @@ struct AveragePooling : public Layer {
         }
       }
     }
-
-    return y;
   }
-
-  virtual void initialize(std::function<double(void)>&) override {};
 };
 
-
+using AveragePooling = AveragePoolingT<double>;
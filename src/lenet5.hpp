@@ -0,0 +1,59 @@
+#pragma once
+#include "neuralnetwork.hpp"
+#include "layers/convolution.hpp"
+#include "layers/fullyconnected.hpp"
+#include "layers/function.hpp"
+#include "layers/pool.hpp"
+
+// The network owns its layers, so they have to live on the heap.
+template <class T = double>
+inline NeuralNetworkT<T> lenet5(ConvolutionEngine engine = ConvolutionEngine::Im2col, simd::Accuracy accuracy = simd::Accuracy::Accurate) {
+  using Channels = std::vector<typename ConvolutionT<T>::Channel>;
+  auto C1 = new ConvolutionT<T>(28, 28, 1, 5, 5, 2, Channels{
+      {{0}},
+      {{0}},
+      {{0}},
+      {{0}},
+      {{0}},
+      {{0}},
+      });
+  auto C4 = new ConvolutionT<T>(14, 14, 6, 5, 5, 0, Channels{
+      {{0, 1, 2}},
+      {{1, 2, 3}},
+      {{2, 3, 4}},
+      {{3, 4, 5}},
+      {{0, 4, 5}},
+      {{0, 1, 5}},
+      {{0, 1, 2, 3}},
+      {{1, 2, 3, 4}},
+      {{2, 3, 4, 5}},
+      {{0, 3, 4, 5}},
+      {{0, 1, 4, 5}},
+      {{0, 1, 2, 5}},
+      {{0, 1, 3, 4}},
+      {{1, 2, 4, 5}},
+      {{0, 2, 3, 5}},
+      {{0, 1, 2, 3, 4, 5}}
+      });
+  C1->engine = engine;
+  C4->engine = engine;
+
+  NeuralNetworkT<T> nn{
+    C1,
+    new SigmoidT<T>(accuracy),
+    new AveragePoolingT<T>(28, 28, 2, 2),
+    C4,
+    new SigmoidT<T>(accuracy),
+    new AveragePoolingT<T>(10, 10, 2, 2),
+    new FullyConnectedT<T>(5*5*16, 120),
+    new SigmoidT<T>(accuracy),
+    new FullyConnectedT<T>(120, 84),
+    new SigmoidT<T>(accuracy),
+    new FullyConnectedT<T>(84, 10)
+  };
+  char const * const names[] = {"C1", "S2", "P3", "C4", "S5", "P6", "F7", "S8", "F9", "S10", "F11"};
+  for (size_t i = 0; i < nn.layers.size(); ++i) {
+    nn.layers[i]->name = names[i];
+  }
+  return nn;
+}
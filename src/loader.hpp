@@ -0,0 +1,152 @@
+#pragma once
+#include "data.hpp"
+#include "math.hpp"
+#include "profiler.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+// Produces shuffled, normalized training batches on its own thread, one batch ahead of the trainer.
+// There are two batch buffers: while the trainer works on one, the loader fills the other. Both are allocated once
+// and reused, so steady state loading doesn't allocate.
+//
+// Every epoch reshuffles the indices with a mt19937 seeded once from the SGD seed, so the sequence of batches is
+// reproducible. Incomplete batches at the end of an epoch are dropped.
+template <class T>
+struct BatchLoaderT {
+  struct Augmentation {
+    size_t shift = 0; // Translates every image by up to shift pixels in both directions, 0 disables it
+  };
+
+  struct Batch {
+    VecT<T> xs;
+    std::vector<uint8_t> labels;
+    size_t n = 0;
+    size_t epoch = 0;
+    size_t index = 0; // Within the epoch
+  };
+
+  Images const& images;
+  size_t const batch_size;
+  size_t const nbatches; // Per epoch
+
+  BatchLoaderT(Images const& images, size_t batch_size, uint32_t seed, Augmentation augmentation = {}):
+    images{images}, batch_size{batch_size}, nbatches{images.size() / batch_size}, augmentation{augmentation}, rng(seed), augment_rng(seed + 1) {
+    if (this->nbatches == 0) {
+      std::cerr << "Batch size " << batch_size << " exceeds the " << images.size() << " images" << std::endl;
+      std::exit(1);
+    }
+    for (Batch& batch : this->batches) {
+      batch.xs.elements.resize(batch_size * images.image_size());
+      batch.labels.resize(batch_size);
+      batch.n = batch_size;
+    }
+    this->thread = std::thread([this](){ this->produce(); });
+  }
+
+  BatchLoaderT(BatchLoaderT const&) = delete;
+  BatchLoaderT& operator=(BatchLoaderT const&) = delete;
+
+  ~BatchLoaderT() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->changed.notify_all();
+    this->thread.join();
+  }
+
+  // Blocks until the next batch is ready. It stays valid until the following call.
+  Batch const& next() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->current < 2) {
+      this->ready[this->current] = false;
+      this->changed.notify_all();
+    }
+    size_t const slot = this->current < 2 ? 1 - this->current : 0;
+    this->changed.wait(lock, [this, slot](){ return this->ready[slot]; });
+    this->current = slot;
+    return this->batches[slot];
+  }
+
+  private:
+  Augmentation const augmentation;
+  std::mt19937 rng;
+  std::mt19937 augment_rng; // Separate, so augmenting doesn't change the shuffles
+
+  Batch batches[2];
+  bool ready[2] = {false, false};
+  size_t current = 2; // The slot the trainer holds, 2 before the first batch
+  bool stopping = false;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread thread;
+
+  void produce() {
+    profiler::name_thread("loader");
+    std::vector<size_t> indices(this->images.size());
+    size_t slot = 0;
+    for (size_t epoch = 0;; ++epoch) {
+      std::iota(indices.begin(), indices.end(), 0);
+      std::shuffle(std::begin(indices), std::end(indices), this->rng);
+
+      for (size_t index = 0; index < this->nbatches; ++index) {
+        {
+          std::unique_lock<std::mutex> lock(this->mutex);
+          this->changed.wait(lock, [this, slot](){ return this->stopping || !this->ready[slot]; });
+          if (this->stopping) return;
+        }
+
+        Batch& batch = this->batches[slot];
+        batch.epoch = epoch;
+        batch.index = index;
+        {
+          profiler::Scope scope("batch", "load");
+          this->fill(&indices[index * this->batch_size], batch);
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(this->mutex);
+          this->ready[slot] = true;
+        }
+        this->changed.notify_all();
+        slot = 1 - slot;
+      }
+    }
+  }
+
+  void fill(size_t const * indices, Batch& batch) {
+    size_t const isize = this->images.image_size();
+    for (size_t i = 0; i < batch.n; ++i) {
+      T * const x = &batch.xs[i * isize];
+      if (this->augmentation.shift) {
+        this->shifted(indices[i], x);
+      } else {
+        this->images.normalize(indices[i], x);
+      }
+      batch.labels[i] = this->images.label(indices[i]);
+    }
+  }
+
+  // Normalizes image idx moved by a random offset, the uncovered border becomes 0
+  void shifted(size_t idx, T * out) {
+    std::uniform_int_distribution<int> offset(-int(this->augmentation.shift), int(this->augmentation.shift));
+    int const drow = offset(this->augment_rng);
+    int const dcol = offset(this->augment_rng);
+    int const rows = this->images.rows;
+    int const columns = this->images.columns;
+    uint8_t const * const image = this->images.image(idx);
+
+    for (int row = 0; row < rows; ++row) {
+      int const srow = row - drow;
+      for (int col = 0; col < columns; ++col) {
+        int const scol = col - dcol;
+        bool const inside = srow >= 0 && srow < rows && scol >= 0 && scol < columns;
+        out[row*columns + col] = inside ? T(image[srow*columns + scol] * this->images.scale) : T(0);
+      }
+    }
+  }
+};
@@ -1,27 +1,69 @@
 #include <iostream>
+#ifndef MNIST_HEADLESS
 #include <GLFW/glfw3.h>
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
+#else
+struct GLFWwindow;
+#endif
 #include "data.hpp"
 #include "math.hpp"
-#include "layers/fullyconnected.hpp"
-#include "layers/function.hpp"
-#include "layers/pool.hpp"
-#include "layers/convolution.hpp"
 #include "neuralnetwork.hpp"
+#include "lenet5.hpp"
+#include "trainer.hpp"
+#include "loader.hpp"
+#include "evaluator.hpp"
+#include "spsc.hpp"
+#include "history.hpp"
+#include "profiler.hpp"
+#include "allocations.hpp"
+#include "checks.hpp"
 #include <memory>
 #include <random>
 #include <charconv>
 #include <algorithm>
 #include <fstream>
-
-GLuint create_texture_from_pixels(double const * const pixels, int rows, int columns) {
-    std::vector<uint8_t> bytes(rows*columns);
-    for (int i = 0; i < rows*columns; ++i) {
-        bytes[i] = 255 * pixels[i];
-    }
-    
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <optional>
+
+#ifdef MNIST_TRACK_ALLOCATIONS
+// Counts every heap allocation for allocations.hpp, the memory itself still comes from malloc.
+// GCC can't tell that free matches these news once they are inlined.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void * operator new(size_t size) {
+    allocations::note(size);
+    if (void * p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void * operator new(size_t size, std::align_val_t align) {
+    allocations::note(size);
+    size_t const a = static_cast<size_t>(align);
+    // aligned_alloc wants a multiple of the alignment
+    if (void * p = std::aligned_alloc(a, (std::max<size_t>(size, 1) + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+void * operator new[](size_t size) { return ::operator new(size); }
+void * operator new[](size_t size, std::align_val_t align) { return ::operator new(size, align); }
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete[](void * p) noexcept { std::free(p); }
+void operator delete(void * p, size_t) noexcept { std::free(p); }
+void operator delete[](void * p, size_t) noexcept { std::free(p); }
+void operator delete(void * p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void * p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void * p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void * p, size_t, std::align_val_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+#endif
+
+#ifndef MNIST_HEADLESS
+GLuint create_texture_from_pixels(uint8_t const * const pixels, int rows, int columns) {
     GLuint textureID;
     glGenTextures(1, &textureID);
     glBindTexture(GL_TEXTURE_2D, textureID);
@@ -31,10 +73,11 @@ GLuint create_texture_from_pixels(double const * const pixels, int rows, int col
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, columns, rows, 0, GL_RED, GL_UNSIGNED_BYTE, bytes.data());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, columns, rows, 0, GL_RED, GL_UNSIGNED_BYTE, pixels);
 
     return textureID;
 }
+#endif
 
 struct CLIOptions {
     char const * from_weights;
@@ -42,12 +85,33 @@ struct CLIOptions {
     char const * sgd_seed;
     char const * w_seed;
     size_t eval;
+    size_t eval_begin;  // Test images [eval_begin, eval_end) are classified in batches, none when eval_end is 0
+    size_t eval_end;
+    size_t eval_batch;
+    bool headless;
+    size_t epochs;      // 0 means no limit
+    double time_budget; // Seconds, 0 means no limit
+    double target_accuracy; // Fraction of the test set, 0 means no target
+    Convolution::Engine conv_engine;
+    bool float32;
+    simd::Accuracy sigmoid;
+    size_t threads;
+    size_t augment_shift;
+    size_t eval_every; // Training steps between test set evaluations, 0 disables them
+    bool profile;      // Print the per-layer timings at the end
+    bool perf_counters; // Add hardware counters to the profile
+    double peak_gflops; // The machine's roofs for the profile's roofline, 0 when unknown
+    double peak_gbs;
+    size_t allocation_budget; // Most allocations a training step may make after the first, SIZE_MAX for no limit
+    char const * trace; // Chrome trace JSON written at the end
+    bool check_sigmoid; // Only check the sigmoid's error bounds
+    bool check_allocations; // Only check that training and inference don't allocate after warming up
 };
 
 #define PS(p) ((p) ? (p) : "-")
 
 std::ostream& operator<<(std::ostream& os, CLIOptions const& opts) {
-    os << "from_weights: " << PS(opts.from_weights) << ", weights_out: " << PS(opts.weights_out) << ", sgd_seed: " << PS(opts.sgd_seed) << ", w_seed: " << PS(opts.w_seed) << ", eval: " << opts.eval;
+    os << "from_weights: " << PS(opts.from_weights) << ", weights_out: " << PS(opts.weights_out) << ", sgd_seed: " << PS(opts.sgd_seed) << ", w_seed: " << PS(opts.w_seed) << ", eval: " << opts.eval << ", eval_range: " << (opts.eval_end == SIZE_MAX ? "all" : opts.eval_end ? std::to_string(opts.eval_begin) + ":" + std::to_string(opts.eval_end) : "-") << ", eval_batch: " << opts.eval_batch << ", headless: " << opts.headless << ", epochs: " << opts.epochs << ", time_budget: " << opts.time_budget << ", target_accuracy: " << opts.target_accuracy << ", conv_engine: " << (opts.conv_engine == Convolution::Engine::Direct ? "direct" : "im2col") << ", precision: " << (opts.float32 ? "float" : "double") << ", sigmoid: " << simd::name(opts.sigmoid) << ", threads: " << opts.threads << ", augment_shift: " << opts.augment_shift << ", eval_every: " << opts.eval_every << ", profile: " << opts.profile << ", perf_counters: " << opts.perf_counters << ", peak_gflops: " << opts.peak_gflops << ", peak_gbs: " << opts.peak_gbs << ", allocation_budget: " << (opts.allocation_budget == SIZE_MAX ? "-" : std::to_string(opts.allocation_budget)) << ", trace: " << PS(opts.trace) << ", check_sigmoid: " << opts.check_sigmoid << ", check_allocations: " << opts.check_allocations;
     return os;
 }
 
@@ -61,121 +125,388 @@ char * next_or_error(char ** argv, char const * const emsg) {
     return *next;
 }
 
-int main(int argc, char ** argv) {
-    auto const DATA = data("./data");
+template <class T>
+T parse_or_error(char const * const s, char const * const emsg) {
+    T v;
+    auto const result = std::from_chars(s, s + strlen(s), v);
+    if (result.ec != std::errc() || result.ptr != s + strlen(s)) {
+        std::cerr << emsg << s << std::endl;
+        std::exit(1);
+    }
+    return v;
+}
 
-    CLIOptions opts = {};
+// What the trainer reports to the UI after every step
+struct Metrics {
+    size_t step;
+    float train_loss; // log of the mean loss of the batch
+    bool evaluated;   // Whether the eval fields are set
+    float eval_loss;  // log of the mean test set loss
+    float eval_accuracy;
+};
 
-    for (char ** arg = &argv[1]; arg != &argv[argc]; ++arg) {
-        if (strcmp(*arg, "--from-weights") == 0) {
-            opts.from_weights = next_or_error(arg, "Missing --from-weights argument"); 
-        } else if (strcmp(*arg, "--weights-out") == 0) {
-            opts.weights_out = next_or_error(arg, "Missing --weights-out argument");
-        } else if (strcmp(*arg, "--seed-weights") == 0) {
-            opts.w_seed = next_or_error(arg, "Missing --seed-weights argument");
-        } else if (strcmp(*arg, "--seed-sgd") == 0) {
-            opts.sgd_seed = next_or_error(arg, "Missing --seed-sgd argument");
-        } else if (strcmp(*arg, "--eval") == 0) {
-            char const * const evals = next_or_error(arg, "Missing --eval argument");
-            size_t v;
-            auto const result = std::from_chars(evals, evals + strlen(evals), v);
-            if (result.ec != std::errc()) {
-                std::cerr << "Invalid --eval argument: " << evals << std::endl;
-                std::exit(1);
+// What the UI asks of the trainer, applied between steps
+struct Command {
+    enum class Kind {
+        Pause,
+        Resume,
+        Stop,
+        SetLearningRate,
+        SaveCheckpoint,
+    } kind;
+    double value; // The learning rate for SetLearningRate
+};
+
+struct Channels {
+    SpscQueue<Metrics, 4096> metrics; // Trainer to UI, dropped when the UI falls behind
+    SpscQueue<Command, 64> commands;  // UI to trainer
+    std::atomic<bool> done{false};
+};
+
+template <class Confusion>
+void print_confusion(Confusion const& confusion) {
+    std::cout << "Confusion matrix (rows are labels, columns guesses):" << std::endl;
+    for (auto const& row : confusion) {
+        for (size_t count : row) {
+            std::cout << std::setw(6) << count;
+        }
+        std::cout << std::endl;
+    }
+}
+
+template <class Result>
+void print_evaluation(Result const& result) {
+    std::cout << "Test accuracy after " << result.step << " steps: " << result.accuracy << ", loss: " << result.loss << std::endl;
+    print_confusion(result.confusion);
+}
+
+// Classifies images [begin, end) in batches of batch_size, on nthreads threads sharing nn, and prints the accuracy,
+// the confusion matrix, the throughput and the latency percentiles of the batches. A batch's latency runs from
+// normalizing its images to having their guesses and loss.
+template <class T>
+void evaluate_range(NeuralNetworkT<T> const& nn, Images const& images, size_t begin, size_t end, size_t batch_size, size_t nthreads) {
+    using Evaluator = EvaluatorT<T>;
+    // What every thread gathers, merged at the end
+    struct Tally {
+        typename Evaluator::Confusion confusion = {};
+        double loss = 0;
+        std::vector<double> latencies; // Seconds
+    };
+
+    size_t const nbatches = (end - begin + batch_size - 1) / batch_size;
+    std::vector<Tally> tallies(nthreads);
+    std::atomic<size_t> next{0};
+    auto const work = [&](size_t t){
+        profiler::name_thread(("inference " + std::to_string(t)).c_str());
+        Tally& tally = tallies[t];
+        typename NeuralNetworkT<T>::InferenceContext context;
+        VecT<T> xs;
+        // Batches are handed out one at a time, so a slow thread doesn't hold the others back
+        for (size_t batch; (batch = next++) < nbatches;) {
+            size_t const start = begin + batch * batch_size;
+            auto const batch_start = std::chrono::steady_clock::now();
+            tally.loss += Evaluator::tally(nn, images, start, std::min(start + batch_size, end), xs, context, tally.confusion);
+            tally.latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count());
+        }
+    };
+
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nthreads; ++t) {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Tally total;
+    for (Tally const& tally : tallies) {
+        for (size_t label = 0; label < NCLASSES; ++label) {
+            for (size_t guess = 0; guess < NCLASSES; ++guess) {
+                total.confusion[label][guess] += tally.confusion[label][guess];
             }
-            opts.eval = v + 1;
         }
+        total.loss += tally.loss;
+        total.latencies.insert(total.latencies.end(), tally.latencies.begin(), tally.latencies.end());
     }
+    size_t const correct = Evaluator::correct(total.confusion);
+    std::sort(total.latencies.begin(), total.latencies.end());
+    // Nearest rank, so every percentile is a measured latency
+    auto const percentile = [&](double p){
+        size_t const rank = std::max<size_t>(1, size_t(std::ceil(p * total.latencies.size())));
+        return 1e3 * total.latencies[rank - 1];
+    };
 
-    std::cout << "Running with options=" << opts << std::endl;
+    size_t const nimages = end - begin;
+    std::cout << "Classified test images [" << begin << ", " << end << ") in batches of " << batch_size << " on " << nthreads
+              << " threads in " << seconds << "s: " << nimages / seconds << " images/s" << std::endl;
+    std::cout << "Accuracy: " << double(correct) / nimages << " (" << correct << "/" << nimages << "), loss: " << total.loss / nimages << std::endl;
+    print_confusion(total.confusion);
+    std::cout << "Batch latency (ms) over " << total.latencies.size() << " batches: p50 " << percentile(0.5) << ", p90 " << percentile(0.9)
+              << ", p99 " << percentile(0.99) << ", max " << total.latencies.back() * 1e3 << std::endl;
+}
 
-    /*
-    auto TEST = Convolution(3, 3, 2, 3, 3, 1, std::vector<Convolution::Channel>{
-            {{0, 1}},
-            {{1}},
-            });
-    TEST.forward(Vec());
-    std::exit(0);
-    */
+// Trains until one of the stopping criteria in opts is met or the UI says stop. Reports to the UI only when
+// publish is set, nobody would drain the queue otherwise. Returns the allocations of every step, which are only
+// counted in builds with MNIST_TRACK_ALLOCATIONS.
+template <class T>
+allocations::Tally train_loop(CLIOptions const& opts, NeuralNetworkT<T>& lenet5, Data const& DATA, uint32_t sgd_seed, double learning_rate,
+                Channels& channels, bool publish) {
+    size_t const BATCH_SIZE = 100;
+    BatchLoaderT<T> loader(DATA.train, BATCH_SIZE, sgd_seed, {.shift = opts.augment_shift});
+    size_t const NBATCHES = loader.nbatches;
+    size_t epoch = 0;
+
+    ParallelTrainerT<T> trainer(lenet5, opts.threads);
+
+    // A second network and a thread, only when something reads the test set accuracy
+    std::optional<EvaluatorT<T>> evaluator;
+    if (opts.eval_every || opts.target_accuracy > 0) {
+        evaluator.emplace(DATA.test, [&opts](){ return ::lenet5<T>(opts.conv_engine, opts.sigmoid); });
+    }
+    size_t step = 0;
+    float last_loss = 0;
+    allocations::Tally step_allocations;
+
+    auto const start = std::chrono::steady_clock::now();
+    auto const elapsed = [&start](){ return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    bool close = false;
+    bool paused = false;
+    auto const apply_commands = [&](){
+        while (auto const command = channels.commands.pop()) {
+            switch (command->kind) {
+                case Command::Kind::Pause: paused = true; break;
+                case Command::Kind::Resume: paused = false; break;
+                case Command::Kind::Stop: close = true; break;
+                case Command::Kind::SetLearningRate:
+                    learning_rate = command->value;
+                    std::cout << "Learning rate set to " << learning_rate << std::endl;
+                    break;
+                case Command::Kind::SaveCheckpoint: {
+                    char const * const path = opts.weights_out ? opts.weights_out : "checkpoint.bin";
+                    std::ofstream weights(path, std::fstream::binary);
+                    lenet5.dump_weights(weights);
+                    std::cout << "Saved checkpoint to " << path << " after " << step << " steps" << std::endl;
+                    break;
+                }
+            }
+        }
+    };
+
+    // Main loop
+    while (!close) {
+        /**************************************************************************************************/
+        std::cout << "Epoch:" << epoch << std::endl;
+
+        auto const epoch_start = std::chrono::steady_clock::now();
+        size_t batch = 0;
+        for (; batch < NBATCHES && !close; ++batch) {
+            apply_commands();
+            while (paused && !close) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                apply_commands();
+            }
+            if (close) break;
+
+            std::cout << "Batch: " << batch << "/" << NBATCHES << std::endl;
+            profiler::Scope scope("step", "train");
+            allocations::Measure const allocated;
+            auto const& next = [&]() -> auto const& {
+                profiler::Scope scope("wait", "load");
+                return loader.next();
+            }();
+            double const tloss = trainer.train_batch(next.xs, next.labels.data(), next.n);
+            last_loss = std::log(tloss / BATCH_SIZE);
+            lenet5.descend_gradient(learning_rate / BATCH_SIZE);
+            ++step;
+
+            /*
+               std::ofstream after("after", std::fstream::binary);
+               lenet5.dump_weights(after);
+               std::exit(0);
+               */
+
+            Metrics metrics = {.step = step, .train_loss = last_loss, .evaluated = false, .eval_loss = 0, .eval_accuracy = 0};
+            if (opts.eval_every && step % opts.eval_every == 0) {
+                evaluator->submit(step, lenet5.params);
+            }
+            if (auto const result = evaluator ? evaluator->poll() : std::nullopt) {
+                metrics.evaluated = true;
+                metrics.eval_loss = std::log(result->loss);
+                metrics.eval_accuracy = result->accuracy;
+                std::cout << "Step " << result->step << ": test accuracy " << result->accuracy << ", loss " << result->loss << std::endl;
+                if (opts.target_accuracy > 0 && result->accuracy >= opts.target_accuracy) {
+                    std::cout << "Target accuracy of " << opts.target_accuracy << " reached" << std::endl;
+                    close = true;
+                }
+            }
+            if (publish) {
+                channels.metrics.push(metrics);
+            }
+
+            if (opts.time_budget > 0 && elapsed() >= opts.time_budget) {
+                std::cout << "Time budget of " << opts.time_budget << "s reached" << std::endl;
+                close = true;
+            }
+            step_allocations.add(allocated.elapsed());
+        }
+
+        double const epoch_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch_start).count();
+        std::cout << "Epoch " << epoch << " trained " << batch * BATCH_SIZE << " images in " << epoch_seconds << "s ("
+                  << batch * BATCH_SIZE / epoch_seconds << " images/s)" << std::endl;
 
-    // Initialize GLFW
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        return -1;
+        ++epoch;
+        if (opts.epochs && epoch >= opts.epochs) {
+            std::cout << "Trained for " << epoch << " epochs" << std::endl;
+            close = true;
+        }
+        // The evaluator measures it in the background, training stops once a result reaches the target
+        if (opts.target_accuracy > 0 && !close) {
+            evaluator->submit(step, lenet5.params);
+        }
+        /**************************************************************************************************/
     }
 
-    // Create a windowed mode window and its OpenGL context
-    GLFWwindow* window = glfwCreateWindow(1280, 720, "ImGui Example", NULL, NULL);
-    if (!window) {
-        std::cerr << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+    if (opts.weights_out) {
+        std::ofstream weights(opts.weights_out, std::fstream::binary);
+        lenet5.dump_weights(weights);
+    }
+    if (opts.eval_every) {
+        evaluator->submit(step, lenet5.params);
+        if (auto const result = evaluator->wait()) {
+            print_evaluation(*result);
+        }
+    }
+    if (step) {
+        std::cout << "Last log(training loss) was: " << last_loss << std::endl;
+    }
+    if (allocations::TRACKING && step_allocations.n) {
+        allocations::Tally const& a = step_allocations;
+        std::cout << "Allocations in the first step: " << a.first.count << " (" << a.first.bytes / 1024 << " KB)";
+        if (a.n > 1) {
+            std::cout << ", in the " << a.n - 1 << " others: " << double(a.total.count - a.first.count) / (a.n - 1)
+                      << " (" << (a.total.bytes - a.first.bytes) / (a.n - 1) / 1024 << " KB) on average, at most "
+                      << a.max.count << " (" << a.max.bytes / 1024 << " KB)";
+        }
+        std::cout << std::endl;
+        std::cout << "Peak RSS: " << allocations::peak_rss_bytes() / (1024 * 1024) << " MB" << std::endl;
+    }
+    return step_allocations;
+}
+
+// Fails the run when a step after the first allocated more than --allocation-budget allows
+void check_allocation_budget(CLIOptions const& opts, allocations::Tally const& steps) {
+    if (opts.allocation_budget != SIZE_MAX && steps.n > 1 && steps.max.count > opts.allocation_budget) {
+        std::cerr << "A training step made " << steps.max.count << " allocations, over the budget of " << opts.allocation_budget << std::endl;
+        std::exit(1);
     }
+}
 
-    // Make the window's context current
-    glfwMakeContextCurrent(window);
+#ifndef MNIST_HEADLESS
+// Draws the losses and the training controls at a fixed frame rate until training is done, independently of how
+// fast the trainer steps
+void ui_loop(GLFWwindow* window, Channels& channels, double learning_rate) {
+    auto const FRAME = std::chrono::microseconds(1000000 / 60);
+
+    History loss_train;
+    History loss_eval;
+    size_t step = 0;
+    float eval_accuracy = 0;
+    bool paused = false;
+    float rate = learning_rate;
+
+    auto next_frame = std::chrono::steady_clock::now();
+    while (!channels.done) {
+        while (auto const metrics = channels.metrics.pop()) {
+            step = metrics->step;
+            loss_train.push(metrics->train_loss);
+            if (metrics->evaluated) {
+                loss_eval.push(metrics->eval_loss);
+                eval_accuracy = metrics->eval_accuracy;
+            }
+        }
 
-    // Setup ImGui context
-    IMGUI_CHECKVERSION();
-    ImGui::CreateContext();
-    ImGuiIO& io = ImGui::GetIO(); (void)io;
+        // The frame is timed until its buffers are swapped, not through the wait for the next one
+        {
+            profiler::Scope frame("frame", "ui");
+            /************* ImGui stuff *********************/
+            // Start the ImGui frame
+            glfwPollEvents();
+            if (glfwWindowShouldClose(window)) {
+                channels.commands.push({.kind = Command::Kind::Stop, .value = 0});
+                break;
+            }
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+
+            // Create a simple window
+            ImGui::Begin("Hello, ImGui!");
+
+            ImGui::Text("Step %zu, test accuracy %.4f", step, eval_accuracy);
+            if (ImGui::Button(paused ? "Resume" : "Pause")) {
+                paused = !paused;
+                channels.commands.push({.kind = paused ? Command::Kind::Pause : Command::Kind::Resume, .value = 0});
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Stop")) {
+                channels.commands.push({.kind = Command::Kind::Stop, .value = 0});
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Save checkpoint")) {
+                channels.commands.push({.kind = Command::Kind::SaveCheckpoint, .value = 0});
+            }
+            if (ImGui::InputFloat("Learning rate", &rate, 0.01f, 0.1f, "%.4f", ImGuiInputTextFlags_EnterReturnsTrue)) {
+                channels.commands.push({.kind = Command::Kind::SetLearningRate, .value = rate});
+            }
 
-    // Setup ImGui style
-    ImGui::StyleColorsDark();
+            if (!loss_eval.empty() && !loss_train.empty()) {
+                float const ymin = std::min(loss_train.min(), loss_eval.min());
+                float const ymax = std::max(loss_train.max(), loss_eval.max());
 
-    // Setup Platform/Renderer backends
-    ImGui_ImplGlfw_InitForOpenGL(window, true);
-    ImGui_ImplOpenGL3_Init("#version 130");
+                // Both plot the mean of every bucket, at most a History's capacity points
+                auto const mean = [](void* buckets, int i){ return static_cast<History::Bucket const *>(buckets)[i].mean(); };
+                auto const& train = loss_train.summary();
+                auto const& eval = loss_eval.summary();
+                ImGui::PlotLines("Train", mean, (void*)train.data(), train.size(), 0, nullptr, ymin, ymax, ImVec2(0, 240));
+                ImGui::PlotLines("Eval", mean, (void*)eval.data(), eval.size(), 0, nullptr, ymin, ymax, ImVec2(0, 240));
+            }
 
-    auto C1  = Convolution(28, 28, 1, 5, 5, 2, std::vector<Convolution::Channel>{
-            {{0}},
-            {{0}},
-            {{0}},
-            {{0}},
-            {{0}},
-            {{0}},
-            });
-    auto S2  = Sigmoid();
-    auto P3  = AveragePooling(28, 28, 2, 2);
-    auto C4  = Convolution(14, 14, 6, 5, 5, 0, std::vector<Convolution::Channel>{
-            {{0, 1, 2}},
-            {{1, 2, 3}},
-            {{2, 3, 4}},
-            {{3, 4, 5}},
-            {{0, 4, 5}},
-            {{0, 1, 5}},
-            {{0, 1, 2, 3}},
-            {{1, 2, 3, 4}},
-            {{2, 3, 4, 5}},
-            {{0, 3, 4, 5}},
-            {{0, 1, 4, 5}},
-            {{0, 1, 2, 5}},
-            {{0, 1, 3, 4}},
-            {{1, 2, 4, 5}},
-            {{0, 2, 3, 5}},
-            {{0, 1, 2, 3, 4, 5}}
-            });
-    auto S5  = Sigmoid();
-    auto P6  = AveragePooling(10, 10, 2, 2);
-    auto F7  = FullyConnected(5*5*16, 120);
-    auto S8  = Sigmoid();
-    auto F9  = FullyConnected(120, 84);
-    auto S10 = Sigmoid();
-    auto F11 = FullyConnected(84, 10);
-
-    NeuralNetwork lenet5{
-        &C1,
-        &S2,
-        &P3,
-        &C4,
-        &S5,
-        &P6,
-        &F7,
-        &S8,
-        &F9,
-        &S10,
-        &F11
-    };
+            /*
+               ImGui::Text("Train image");
+               for (size_t i = 0; i < NIMAGES; ++i) ImGui::Image((void*)(intptr_t)textureIds[i], ImVec2(28, 28));
+               */
+            ImGui::End();
+            // Rendering
+            ImGui::Render();
+            int display_w, display_h;
+            glfwGetFramebufferSize(window, &display_w, &display_h);
+            glViewport(0, 0, display_w, display_h);
+            glClearColor(0.45f, 0.55f, 0.60f, 1.00f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+
+            glfwSwapBuffers(window);
+            /************* ImGui stuff *********************/
+        }
+
+        next_frame += FRAME;
+        std::this_thread::sleep_until(next_frame);
+    }
+}
+#endif
+
+// Returns the allocations of the training steps, if it trained
+template <class T>
+allocations::Tally run(CLIOptions const& opts, GLFWwindow* window) {
+#ifdef MNIST_HEADLESS
+    (void)window;
+#endif
+    Data const DATA = data("./data");
+    NeuralNetworkT<T> lenet5 = ::lenet5<T>(opts.conv_engine, opts.sigmoid);
 
     if (opts.from_weights) {
         std::ifstream in(opts.from_weights, std::fstream::binary);
@@ -185,7 +516,7 @@ int main(int argc, char ** argv) {
         if (opts.w_seed) {
             uint32_t s;
             auto cresult = std::from_chars(opts.w_seed, opts.w_seed + strlen(opts.w_seed), s);
-            if (cresult.ec == std::errc()) {
+            if (cresult.ec != std::errc()) {
                 std::cerr << "Invalid weights seed: " << opts.w_seed << std::endl;
                 std::exit(-1);
             }
@@ -201,6 +532,22 @@ int main(int argc, char ** argv) {
         std::cout << "Weights seed: " << seed << std::endl;
     }
 
+    if (opts.eval_end) {
+        // --eval-all asks for the whole set, whatever its size
+        size_t const end = opts.eval_end == SIZE_MAX ? DATA.test.size() : opts.eval_end;
+        if (end > DATA.test.size() || opts.eval_begin >= end) {
+            std::cerr << "Invalid --eval-range: the test set has " << DATA.test.size() << " images, END can be at most " << DATA.test.size() << std::endl;
+            std::exit(1);
+        }
+        evaluate_range(lenet5, DATA.test, opts.eval_begin, end, opts.eval_batch, opts.threads);
+        return {};
+    }
+
+    if (opts.eval > DATA.test.size()) {
+        std::cerr << "Invalid --eval: the test set has " << DATA.test.size() << " images, the last being " << DATA.test.size() - 1 << std::endl;
+        std::exit(1);
+    }
+
     if (opts.eval == 0) {
         // Training
        
@@ -208,7 +555,7 @@ int main(int argc, char ** argv) {
         if (opts.sgd_seed) {
             uint32_t s;
             auto cresult = std::from_chars(opts.sgd_seed, opts.sgd_seed + strlen(opts.sgd_seed), s);
-            if (cresult.ec == std::errc()) {
+            if (cresult.ec != std::errc()) {
                 std::cerr << "Invalid SGD seed: " << opts.sgd_seed << std::endl;
                 std::exit(-1);
             }
@@ -216,111 +563,35 @@ int main(int argc, char ** argv) {
         } else {
             sgd_seed = std::random_device{}();
         }
-        std::mt19937 sgd_rng(sgd_seed);
         std::cout << "SGD Seed: " << sgd_seed << std::endl;
 
-        size_t const BATCH_SIZE = 100;
-        size_t const NBATCHES = DATA.train.labels.size() / BATCH_SIZE;
-        size_t const EVAL_SIZE = 100;
-        size_t epoch = 0;
-        double LEARNING_RATE = 0.1;
-
-        std::vector<float> loss_train;
-        std::vector<float> loss_eval;
-
-        // Main loop
-        bool close = false;
-        while (!close) {
-            /**************************************************************************************************/
-            std::vector<size_t> indices(DATA.train.labels.size());
-            std::iota(indices.begin(), indices.end(), 0);
-
-            std::cout << "Epoch:" << epoch << std::endl;
-            std::shuffle(std::begin(indices), std::end(indices), sgd_rng);
-
-            for (size_t batch = 0; batch < NBATCHES && !close; ++batch) {
-                std::cout << "Batch: " << batch << "/" << NBATCHES << std::endl;
-                double tloss = 0.0;
-                for (size_t i = 0; i < BATCH_SIZE; ++i) {
-                    size_t const idx = indices[batch * BATCH_SIZE + i];
-                    double const loss = lenet5.train(DATA.train.images[idx], DATA.train.labels[idx]);
-                    tloss += loss;
-                }
-                loss_train.push_back(std::log(tloss / BATCH_SIZE));
-                lenet5.descend_gradient(LEARNING_RATE / BATCH_SIZE);
-
-                /*
-                   std::ofstream after("after", std::fstream::binary);
-                   lenet5.dump_weights(after);
-                   std::exit(0);
-                   */
-
-
-                double eloss = 0;
-                for (size_t i = 0; i < EVAL_SIZE; ++i) {
-                    double const loss = lenet5.train(DATA.test.images[i], DATA.test.labels[i]);
-                    eloss += loss;
-                }
-                loss_eval.push_back(std::log(eloss / EVAL_SIZE));
-
-                /************* ImGui stuff *********************/
-                // Start the ImGui frame
-                glfwPollEvents();
-                if (glfwWindowShouldClose(window)) {
-                    close = true;
-                    break;
-                }
-                ImGui_ImplOpenGL3_NewFrame();
-                ImGui_ImplGlfw_NewFrame();
-                ImGui::NewFrame();
-
-                // Create a simple window
-                ImGui::Begin("Hello, ImGui!");
-
-                if (loss_eval.size() && loss_train.size()) {
-                    float const ymin = std::min(*std::min_element(std::begin(loss_train), std::end(loss_train)),
-                            *std::min_element(std::begin(loss_eval), std::end(loss_eval)));
-                    float const ymax = std::max(*std::max_element(std::begin(loss_train), std::end(loss_train)),
-                            *std::max_element(std::begin(loss_eval), std::end(loss_eval)));
-
-                    ImGui::PlotLines("Train", loss_train.data(), loss_train.size(), 0, nullptr, ymin, ymax, ImVec2(0, 240), sizeof(float));
-                    ImGui::PlotLines("Eval", loss_eval.data(), loss_eval.size(), 0, nullptr, ymin, ymax, ImVec2(0, 240), sizeof(float));
-                }
-
-                /*
-                   ImGui::Text("Train image");
-                   for (size_t i = 0; i < NIMAGES; ++i) ImGui::Image((void*)(intptr_t)textureIds[i], ImVec2(28, 28));
-                   */
-                ImGui::End();
-                // Rendering
-                ImGui::Render();
-                int display_w, display_h;
-                glfwGetFramebufferSize(window, &display_w, &display_h);
-                glViewport(0, 0, display_w, display_h);
-                glClearColor(0.45f, 0.55f, 0.60f, 1.00f);
-                glClear(GL_COLOR_BUFFER_BIT);
-                ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-
-                glfwSwapBuffers(window);
-                /************* ImGui stuff *********************/
-            }
-
-            ++epoch;
-            /**************************************************************************************************/
-        }
-
-        if (opts.weights_out) {
-            std::ofstream weights(opts.weights_out, std::fstream::binary);
-            lenet5.dump_weights(weights);
+        double const LEARNING_RATE = 0.1;
+        Channels channels;
+        allocations::Tally steps;
+        auto const train = [&](){
+            profiler::name_thread("trainer");
+            steps = train_loop(opts, lenet5, DATA, sgd_seed, LEARNING_RATE, channels, window != nullptr);
+            channels.done = true;
+        };
+
+#ifndef MNIST_HEADLESS
+        if (window) {
+            // GLFW wants the window on the main thread, so the trainer moves out instead
+            std::thread trainer(train);
+            ui_loop(window, channels, LEARNING_RATE);
+            trainer.join();
+            return steps;
         }
-        std::cout << "Last log(training loss) was: " << loss_train.back() << std::endl;
+#endif
+        train();
+        return steps;
     } else {
         // Evaluation
         size_t const imgindex = opts.eval - 1;
-        auto const img = create_texture_from_pixels(DATA.test.images[imgindex].data(), 28, 28);
 
-        Vec const x(DATA.test.images[imgindex]);
-        Vec probs = lenet5.forward(x);
+        VecT<T> x(DATA.test.image_size());
+        DATA.test.normalize(imgindex, x.elements.data());
+        VecT<T> probs = lenet5.evaluate_batch(x, 1);
         probs.softmax();
         size_t guess = 0;
         double mprob = 0;
@@ -333,7 +604,9 @@ int main(int argc, char ** argv) {
         std::cout << "Guess is: " << guess << " with probability: " << mprob << std::endl;
         std::cout << "All the probabilities are: " << probs << std::endl;
 
-        while (!glfwWindowShouldClose(window)) {
+#ifndef MNIST_HEADLESS
+        GLuint const img = window ? create_texture_from_pixels(DATA.test.image(imgindex), DATA.test.rows, DATA.test.columns) : 0;
+        while (window && !glfwWindowShouldClose(window)) {
             // Start the ImGui frame
             glfwPollEvents();
             ImGui_ImplOpenGL3_NewFrame();
@@ -358,15 +631,236 @@ int main(int argc, char ** argv) {
 
             glfwSwapBuffers(window);
         }
+#endif
+    }
+    return {};
+}
+
+int main(int argc, char ** argv) {
+
+    CLIOptions opts = {};
+    opts.conv_engine = Convolution::Engine::Im2col;
+    opts.sigmoid = simd::Accuracy::Accurate;
+    opts.threads = std::max(1u, std::thread::hardware_concurrency());
+    opts.eval_every = 100;
+    opts.allocation_budget = SIZE_MAX;
+    opts.eval_batch = 100;
+
+    for (char ** arg = &argv[1]; arg != &argv[argc]; ++arg) {
+        if (strcmp(*arg, "--from-weights") == 0) {
+            opts.from_weights = next_or_error(arg, "Missing --from-weights argument"); 
+        } else if (strcmp(*arg, "--weights-out") == 0) {
+            opts.weights_out = next_or_error(arg, "Missing --weights-out argument");
+        } else if (strcmp(*arg, "--seed-weights") == 0) {
+            opts.w_seed = next_or_error(arg, "Missing --seed-weights argument");
+        } else if (strcmp(*arg, "--seed-sgd") == 0) {
+            opts.sgd_seed = next_or_error(arg, "Missing --seed-sgd argument");
+        } else if (strcmp(*arg, "--eval") == 0) {
+            // The index plus one, the largest size_t would wrap to 0 and train instead
+            opts.eval = parse_or_error<size_t>(next_or_error(arg, "Missing --eval argument"), "Invalid --eval argument: ") + 1;
+            if (opts.eval == 0) {
+                std::cerr << "Invalid --eval argument: no test image has index " << SIZE_MAX << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--eval-all") == 0) {
+            opts.eval_begin = 0;
+            opts.eval_end = SIZE_MAX;
+        } else if (strcmp(*arg, "--eval-range") == 0) {
+            // BEGIN:END, a half-open range of test image indices
+            char const * const range = next_or_error(arg, "Missing --eval-range argument");
+            char const * const colon = strchr(range, ':');
+            char const * const end = range + strlen(range);
+            auto const parses = [](char const * first, char const * last, size_t& v){
+                auto const result = std::from_chars(first, last, v);
+                return result.ec == std::errc() && result.ptr == last;
+            };
+            if (!colon || !parses(range, colon, opts.eval_begin) || !parses(colon + 1, end, opts.eval_end) || opts.eval_begin >= opts.eval_end || opts.eval_end == SIZE_MAX) {
+                std::cerr << "Invalid --eval-range argument, expected BEGIN:END with BEGIN < END: " << range << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--eval-batch") == 0) {
+            opts.eval_batch = parse_or_error<size_t>(next_or_error(arg, "Missing --eval-batch argument"), "Invalid --eval-batch argument: ");
+            if (opts.eval_batch == 0) {
+                std::cerr << "--eval-batch must be at least 1" << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--headless") == 0) {
+            opts.headless = true;
+        } else if (strcmp(*arg, "--epochs") == 0) {
+            opts.epochs = parse_or_error<size_t>(next_or_error(arg, "Missing --epochs argument"), "Invalid --epochs argument: ");
+        } else if (strcmp(*arg, "--time-budget") == 0) {
+            opts.time_budget = parse_or_error<double>(next_or_error(arg, "Missing --time-budget argument"), "Invalid --time-budget argument: ");
+        } else if (strcmp(*arg, "--target-accuracy") == 0) {
+            opts.target_accuracy = parse_or_error<double>(next_or_error(arg, "Missing --target-accuracy argument"), "Invalid --target-accuracy argument: ");
+        } else if (strcmp(*arg, "--threads") == 0) {
+            opts.threads = parse_or_error<size_t>(next_or_error(arg, "Missing --threads argument"), "Invalid --threads argument: ");
+            if (opts.threads == 0) {
+                std::cerr << "--threads must be at least 1" << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--eval-every") == 0) {
+            opts.eval_every = parse_or_error<size_t>(next_or_error(arg, "Missing --eval-every argument"), "Invalid --eval-every argument: ");
+        } else if (strcmp(*arg, "--profile") == 0) {
+            opts.profile = true;
+        } else if (strcmp(*arg, "--perf-counters") == 0) {
+            opts.profile = true;
+            opts.perf_counters = true;
+        } else if (strcmp(*arg, "--peak-gflops") == 0) {
+            opts.peak_gflops = parse_or_error<double>(next_or_error(arg, "Missing --peak-gflops argument"), "Invalid --peak-gflops argument: ");
+        } else if (strcmp(*arg, "--peak-gbs") == 0) {
+            opts.peak_gbs = parse_or_error<double>(next_or_error(arg, "Missing --peak-gbs argument"), "Invalid --peak-gbs argument: ");
+        } else if (strcmp(*arg, "--allocation-budget") == 0) {
+            opts.allocation_budget = parse_or_error<size_t>(next_or_error(arg, "Missing --allocation-budget argument"), "Invalid --allocation-budget argument: ");
+            if (!allocations::TRACKING) {
+                std::cerr << "--allocation-budget needs a build with -DMNIST_TRACK_ALLOCATIONS" << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--check-sigmoid") == 0) {
+            opts.check_sigmoid = true;
+        } else if (strcmp(*arg, "--check-allocations") == 0) {
+            opts.check_allocations = true;
+            if (!allocations::TRACKING) {
+                std::cerr << "--check-allocations needs a build with -DMNIST_TRACK_ALLOCATIONS" << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--trace") == 0) {
+            opts.trace = next_or_error(arg, "Missing --trace argument");
+        } else if (strcmp(*arg, "--augment-shift") == 0) {
+            opts.augment_shift = parse_or_error<size_t>(next_or_error(arg, "Missing --augment-shift argument"), "Invalid --augment-shift argument: ");
+        } else if (strcmp(*arg, "--precision") == 0) {
+            char const * const precision = next_or_error(arg, "Missing --precision argument");
+            if (strcmp(precision, "float") == 0) {
+                opts.float32 = true;
+            } else if (strcmp(precision, "double") == 0) {
+                opts.float32 = false;
+            } else {
+                std::cerr << "Invalid --precision argument: " << precision << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--conv-engine") == 0) {
+            char const * const engine = next_or_error(arg, "Missing --conv-engine argument");
+            if (strcmp(engine, "direct") == 0) {
+                opts.conv_engine = Convolution::Engine::Direct;
+            } else if (strcmp(engine, "im2col") == 0) {
+                opts.conv_engine = Convolution::Engine::Im2col;
+            } else {
+                std::cerr << "Invalid --conv-engine argument: " << engine << std::endl;
+                std::exit(1);
+            }
+        } else if (strcmp(*arg, "--sigmoid") == 0) {
+            char const * const accuracy = next_or_error(arg, "Missing --sigmoid argument");
+            if (strcmp(accuracy, "exact") == 0) {
+                opts.sigmoid = simd::Accuracy::Exact;
+            } else if (strcmp(accuracy, "accurate") == 0) {
+                opts.sigmoid = simd::Accuracy::Accurate;
+            } else if (strcmp(accuracy, "fast") == 0) {
+                opts.sigmoid = simd::Accuracy::Fast;
+            } else {
+                std::cerr << "Invalid --sigmoid argument: " << accuracy << std::endl;
+                std::exit(1);
+            }
+        }
+    }
+
+#ifdef MNIST_HEADLESS
+    opts.headless = true;
+#endif
+    // Batch evaluation only prints, it never opens a window
+    if (opts.eval_end) {
+        opts.headless = true;
+    }
+
+    std::cout << "Running with options=" << opts << std::endl;
+    std::cout << "SIMD kernels: " << simd::name(simd::level()) << std::endl;
+
+    if (opts.check_sigmoid || opts.check_allocations) {
+        // All of them, even when one fails
+        bool ok = true;
+        if (opts.check_sigmoid) {
+            ok &= checks::sigmoid<double>(std::cout);
+            ok &= checks::sigmoid<float>(std::cout);
+        }
+        if (opts.check_allocations) {
+            for (size_t threads : {size_t(1), std::max<size_t>(opts.threads, 4)}) {
+                ok &= checks::allocations<double>(std::cout, threads);
+                ok &= checks::allocations<float>(std::cout, threads);
+            }
+        }
+        return ok ? 0 : 1;
+    }
+
+    /*
+    auto TEST = Convolution(3, 3, 2, 3, 3, 1, std::vector<Convolution::Channel>{
+            {{0, 1}},
+            {{1}},
+            });
+    TEST.forward(Vec());
+    std::exit(0);
+    */
+
+    GLFWwindow* window = nullptr;
+#ifndef MNIST_HEADLESS
+    if (!opts.headless) {
+        // Initialize GLFW
+        if (!glfwInit()) {
+            std::cerr << "Failed to initialize GLFW" << std::endl;
+            return -1;
+        }
+
+        // Create a windowed mode window and its OpenGL context
+        window = glfwCreateWindow(1280, 720, "ImGui Example", NULL, NULL);
+        if (!window) {
+            std::cerr << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return -1;
+        }
+
+        // Make the window's context current
+        glfwMakeContextCurrent(window);
+
+        // Setup ImGui context
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+        ImGuiIO& io = ImGui::GetIO(); (void)io;
+
+        // Setup ImGui style
+        ImGui::StyleColorsDark();
+
+        // Setup Platform/Renderer backends
+        ImGui_ImplGlfw_InitForOpenGL(window, true);
+        ImGui_ImplOpenGL3_Init("#version 130");
     }
+#endif
+
+    if (opts.profile || opts.trace) {
+        profiler::enable(opts.trace != nullptr, opts.perf_counters);
+        profiler::set_peaks(opts.peak_gflops, opts.peak_gbs);
+    }
+
+    allocations::Tally const steps = opts.float32 ? run<float>(opts, window) : run<double>(opts, window);
 
-    // Cleanup
-    ImGui_ImplOpenGL3_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+    if (opts.profile) {
+        profiler::summary(std::cout);
+    }
+    if (opts.trace) {
+        std::ofstream trace(opts.trace);
+        profiler::write_trace(trace);
+        std::cout << "Wrote the trace to " << opts.trace << std::endl;
+    }
+
+#ifndef MNIST_HEADLESS
+    if (window) {
+        // Cleanup
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+#endif
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    check_allocation_budget(opts, steps);
 
     return 0;
 }
@@ -4,110 +4,85 @@
 #include <cmath>
 #include <random>
 #include <algorithm>
+#include <new>
+#include "simd.hpp"
 
-struct Vec {
-  std::vector<double> elements;
+// Allocates on ALIGN byte boundaries, so buffers start on a cache line and a full SIMD vector
+template <class T, size_t ALIGN = 64>
+struct AlignedAllocator {
+  using value_type = T;
 
-  Vec() = default;
-  Vec(size_t s): elements(s) {};
-  Vec(std::vector<double> elems): elements{elems} {};
+  template <class U>
+  struct rebind {
+    using other = AlignedAllocator<U, ALIGN>;
+  };
 
-  double const& operator[](size_t idx) const {
-    return this->elements[idx];
-  }
+  AlignedAllocator() = default;
+  template <class U>
+  AlignedAllocator(AlignedAllocator<U, ALIGN> const&) {}
 
-  double& operator[](size_t idx) {
-    return const_cast<double&>(static_cast<Vec const *>(this)->operator[](idx));
-  }
-
-  size_t size() const {
-    return this->elements.size();
+  T * allocate(size_t n) {
+    return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(ALIGN)));
   }
 
-  void apply(double (*f)(double)) {
-    for (auto& val : this->elements) {
-      val = f(val);
-    }
+  void deallocate(T * p, size_t) {
+    ::operator delete(p, std::align_val_t(ALIGN));
   }
 
-  static double dot(Vec const& l, Vec const& r) {
-    if (l.size() != r.size()) {
-      std::cerr << "Invalid vector dimensions: " << l.size() << " . " << r.size() << std::endl;
-      std::exit(-1);
-    }
-
-    return std::inner_product(l.elements.begin(), l.elements.end(), r.elements.begin(), 0.0);
-  }
+  template <class U>
+  bool operator==(AlignedAllocator<U, ALIGN> const&) const { return true; }
+  template <class U>
+  bool operator!=(AlignedAllocator<U, ALIGN> const&) const { return false; }
+};
 
-  void softmax() {
-    this->apply(std::exp);
-    double sum = 0;
-    for (size_t i = 0; i < this->elements.size(); ++i) {
-      sum += this->elements[i];
-    }
-    for (size_t i = 0; i < this->elements.size(); ++i) {
-      this->elements[i] /= sum;
-    }
-  }
+template <class T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
 
-  Vec slice_n(size_t begin, size_t amount) const {
-    Vec result(amount);
-    for (size_t i = 0; i < amount; ++i) {
-      result[i] = this->elements[begin + i];
-    }
-    return result;
-  }
+// T is the scalar type, double or float. The elements are aligned like the parameter arena, so the batches, the
+// activations and the gradients all start on a cache line.
+template <class T>
+struct VecT {
+  AlignedVector<T> elements;
 
-  void zero() {
-    std::fill(this->elements.begin(), this->elements.end(), 0.0);
-  }
+  VecT() = default;
+  VecT(size_t s): elements(s) {};
+  VecT(std::vector<T> const& elems): elements(elems.begin(), elems.end()) {};
 
-  template <class Random>
-  void initialize(Random& r) {
-    for (auto& el : this->elements) {
-      el = r();
-    }
+  T const& operator[](size_t idx) const {
+    return this->elements[idx];
   }
-};
 
-inline std::ostream& operator<<(std::ostream& out, Vec const& v) {
-  out << "Vec[";
-  for (auto val : v.elements) {
-    out << val << ", ";
+  T& operator[](size_t idx) {
+    return const_cast<T&>(static_cast<VecT const *>(this)->operator[](idx));
   }
-  out << "]";
-  return out;
-}
-
-struct Matrix {
-  size_t rows;
-  size_t columns;
-  std::vector<double> elements;
-
-  Matrix(size_t rows, size_t columns): rows{rows}, columns{columns}, elements(rows*columns) {};
-  Matrix(size_t rows, size_t columns, std::vector<double> elements): rows{rows}, columns{columns}, elements{elements} {};
 
   size_t size() const {
     return this->elements.size();
   }
 
-  double const& at(size_t row, size_t col) const {
-    return this->elements[row*columns + col];
-  }
-
-  double& at(size_t row, size_t col) {
-    return const_cast<double &>(static_cast<Matrix const&>(*this).at(row, col));
-  }
-
-  void add_as_vec(Vec const& o) {
-    if (o.size() != this->rows * this->columns) {
-      std::cerr << "Trying to add vector of dimension " << o.size() << " to matrix of dimension " << this->rows << "x" << this->columns << std::endl;
-      std::exit(-1);
+  // f is opaque, so this stays a scalar loop
+  void apply(T (*f)(T)) {
+    for (auto& val : this->elements) {
+      val = f(val);
     }
+  }
 
-    for (size_t ri = 0; ri < this->rows; ++ri) {
-      for (size_t ci = 0; ci < this->columns; ++ci) {
-        this->at(ri, ci) += o[ri * this->columns + ci];
+  void softmax() {
+    this->softmax_batch(1);
+  }
+
+  // Softmax over each of the n equally sized rows. The row's maximum is subtracted first, so exp can't overflow.
+  void softmax_batch(size_t n) {
+    size_t const rsize = this->elements.size() / n;
+    for (size_t row = 0; row < n; ++row) {
+      T const max = *std::max_element(&this->elements[row*rsize], &this->elements[row*rsize] + rsize);
+      T sum = 0;
+      for (size_t i = row*rsize; i < (row + 1)*rsize; ++i) {
+        this->elements[i] = std::exp(this->elements[i] - max);
+        sum += this->elements[i];
+      }
+      for (size_t i = row*rsize; i < (row + 1)*rsize; ++i) {
+        this->elements[i] /= sum;
       }
     }
   }
@@ -120,99 +95,51 @@ struct Matrix {
   }
 };
 
-inline Vec operator*(double p, Vec const& v) {
-  Vec result(v.elements.size());
-  for (size_t i = 0; i < v.elements.size(); ++i) {
-    result[i] = p * v[i];
-  }
-  return result;
-}
-inline Vec operator*(Vec const& v, double p) {
-  return p * v;
-}
+using Vec = VecT<double>;
 
+// Read only view of size consecutive elements, a whole VecT or a slice of one. Layers read their input through it,
+// so a thread can train on its share of a batch in place.
+template <class T>
+struct VecViewT {
+  T const * values;
+  size_t length;
 
-inline std::ostream& operator<<(std::ostream& out, Matrix const& m) {
-  out << "[";
-  for (size_t ri = 0; ri < m.rows; ++ri) {
-    out << "[";
-    for (size_t ci = 0; ci < m.columns; ++ci) {
-      out << m.at(ri, ci) << ", ";
-    }
-    out << "],\n";
-  }
-  out << "]";
-  return out;
-}
+  VecViewT(T const * values, size_t length): values{values}, length{length} {};
+  VecViewT(VecT<T> const& v): values{v.elements.data()}, length{v.size()} {};
 
-inline Vec operator+(Vec const& l, Vec const& r) {
-  if (l.elements.size() != r.elements.size()) {
-    std::cerr << "Invalid vector dimensions." << l.elements.size() << " + " << r.elements.size() << std::endl;
-    std::exit(1);
+  T const& operator[](size_t idx) const {
+    return this->values[idx];
   }
 
-  Vec result(l.elements.size());
-
-  for (size_t i = 0; i < l.elements.size(); ++i) {
-    result[i] = l[i] + r[i];
+  size_t size() const {
+    return this->length;
   }
 
-  return result;
-}
-
-inline Vec operator-(Vec const& l, Vec const& r) {
-  return l + (-1.*r);
-}
-
-inline Vec operator*(Matrix const& m, Vec const& v) {
-  if (m.columns != v.elements.size()) {
-    std::cerr << "Invalid matrix and vector dimensions: " << m.rows << "x" << m.columns << " * " << v.elements.size() << std::endl;
-    std::exit(1);
+  T const * data() const {
+    return this->values;
   }
+};
 
-  Vec result(m.rows);
-
-  for (size_t oi = 0; oi < result.size(); ++oi) {
-    result[oi] = 0;
-    for (size_t ci = 0; ci < m.columns; ++ci) {
-      result[oi] += m.at(oi, ci) * v[ci];
-    }
+template <class T>
+inline std::ostream& operator<<(std::ostream& out, VecT<T> const& v) {
+  out << "Vec[";
+  for (auto val : v.elements) {
+    out << val << ", ";
   }
-
-  return result;
+  out << "]";
+  return out;
 }
 
-inline Vec grad_mat_mul(Vec const& v, Matrix const& m) {
-  if (m.rows != v.elements.size()) {
-    std::cerr << "Invalid matrix and vector dimensions: (" << m.rows << "x" << m.columns << ")^T * " << v.elements.size() << std::endl;
-    std::exit(1);
-  }
-
-  Vec result(m.columns);
-
-  for (size_t oi = 0; oi < result.size(); ++oi) {
-    result[oi] = 0;
-    for (size_t ri = 0; ri < m.rows; ++ri) {
-      result[oi] += m.at(ri, oi) * v[ri];
-    }
-  }
-
-  return result;
+// Weights files always store doubles, whatever the precision of the network
+template <class T>
+inline void write_scalars(std::ostream& out, T const * values, size_t n) {
+  std::vector<double> const converted(values, values + n);
+  out.write((char const *)converted.data(), n * sizeof(double));
 }
 
-inline Vec hadamard_product(Vec const& l, Vec const& r) {
-  if (l.elements.size() != r.elements.size()) {
-    std::cerr << "Invalid vector dimensions." << l.elements.size() << " * " << r.elements.size() << std::endl;
-    std::exit(1);
-  }
-
-  Vec result(l.elements.size());
-
-  for (size_t i = 0; i < l.elements.size(); ++i) {
-    result[i] = l[i] * r[i];
-  }
-  return result;
+template <class T>
+inline void read_scalars(std::istream& in, T * values, size_t n) {
+  std::vector<double> converted(n);
+  in.read((char *)converted.data(), n * sizeof(double));
+  std::copy(converted.begin(), converted.end(), values);
 }
-
-
-
@@ -2,71 +2,171 @@
 #include "layers/layer.hpp"
 #include "layers/fullyconnected.hpp"
 #include "layers/function.hpp"
+#include "layers/loss.hpp"
 #include <memory>
 #include <vector>
+#include <type_traits>
 #include "math.hpp"
+#include "profiler.hpp"
+#include "workspace.hpp"
 
-struct NeuralNetwork {
-  std::vector<std::unique_ptr<Layer>> layers;
-  std::vector<Vec> gradients; // In reverse order
+template <class T>
+struct NeuralNetworkT {
+  std::vector<std::unique_ptr<LayerT<T>>> layers;
 
-  NeuralNetwork(std::initializer_list<Layer*> init): layers{init.begin(), init.end()} {};
+  // Every layer's parameters, and their accumulated gradients, back to back in one aligned arena.
+  // Layer i owns [offsets[i], offsets[i+1]).
+  std::vector<size_t> offsets;
+  AlignedVector<T> params;
+  AlignedVector<T> gradients;
+
+  NeuralNetworkT(std::initializer_list<LayerT<T>*> init): layers{init.begin(), init.end()} {
+    this->offsets.push_back(0);
+    for (auto const& layer : this->layers) {
+      this->offsets.push_back(this->offsets.back() + layer->nparams());
+    }
+    this->params.resize(this->offsets.back());
+    this->gradients.resize(this->offsets.back());
+    for (size_t i = 0; i < this->layers.size(); ++i) {
+      this->layers[i]->bind(this->params.data() + this->offsets[i]);
+    }
+    this->params_changed();
+  };
+
+  // Whoever writes params directly has to call this before the next batch
+  void params_changed() {
+    for (auto& layer : this->layers) {
+      layer->params_changed();
+    }
+  }
+
+  using Cache = typename LayerT<T>::Cache;
+
+  // What a thread needs to train the network: the activations of the last forward_batch, one buffer per layer
+  // boundary that the layer before writes and the layer after reads, two gradient buffers that backpropagation
+  // alternates between, and the workspace for the layers' temporaries. All of it keeps its capacity, so only the
+  // first batch allocates.
+  struct Context {
+    std::vector<VecT<T>> activations; // activations[i] is layer i's output, the input being the caller's
+    VecT<T> gradients[2];
+    Workspace workspace;
+  };
+  Context context;
+
+  // The most any layer takes from the workspace for a batch of n
+  size_t workspace_size(size_t n) const {
+    size_t size = 0;
+    for (auto const& layer : this->layers) {
+      size = std::max(size, layer->workspace_size(n));
+    }
+    return size;
+  }
 
   void reset() {
-    this->gradients.clear();
+    std::fill(this->gradients.begin(), this->gradients.end(), T(0));
   }
 
-  Vec forward(Vec x) {
-    for (auto& layer : this->layers) {
-      x = layer->forward(x);
+  // x holds n inputs back to back. Only touches context, so threads with their own contexts can share the network.
+  // The result, the n outputs, is the last of context.activations.
+  VecT<T> const& forward_batch(VecViewT<T> x, size_t n, Context& context) const {
+    context.activations.resize(this->layers.size());
+    context.workspace.reserve(this->workspace_size(n));
+    context.workspace.reset();
+    VecViewT<T> in = x;
+    for (size_t i = 0; i < this->layers.size(); ++i) {
+      profiler::Scope scope(this->layers[i]->name, "forward", this->layers[i]->forward_cost(in.size()));
+      this->layers[i]->forward_batch(in, n, context.activations[i], context.workspace);
+      in = context.activations[i];
     }
-    return x;
+    return context.activations.back();
+  }
+
+  // What a thread needs to run inference: two buffers the layers alternate between, and the workspace. Like Context
+  // it keeps its capacity, so after the first batch evaluate_batch doesn't allocate.
+  struct InferenceContext {
+    VecT<T> buffers[2];
+    Workspace workspace;
+  };
+
+  // Inference only: no activations are kept and no gradients touched. Reads nothing but the parameters and writes
+  // nothing but context, so any number of threads can evaluate one network at once, each with its own context. The
+  // result lives in context until its next use.
+  VecT<T> const& evaluate_batch(VecViewT<T> x, size_t n, InferenceContext& context) const {
+    context.workspace.reserve(this->workspace_size(n));
+    context.workspace.reset();
+    VecViewT<T> in = x;
+    for (size_t i = 0; i < this->layers.size(); ++i) {
+      profiler::Scope scope(this->layers[i]->name, "evaluate", this->layers[i]->forward_cost(in.size()));
+      this->layers[i]->forward_batch(in, n, context.buffers[i % 2], context.workspace);
+      in = context.buffers[i % 2];
+    }
+    return context.buffers[(this->layers.size() - 1) % 2];
+  }
+
+  // Same, with a context per thread that lives as long as the thread
+  VecT<T> evaluate_batch(VecT<T> const& x, size_t n) const {
+    thread_local InferenceContext context;
+    return this->evaluate_batch(x, n, context);
   }
 
-  double train(Vec const& x, Vec const& y) {
-     Vec output = this->forward(x);
-     output.softmax();
-     Vec const error = output - y;
-     
-     Layer::Gradient grad = {.dx = error, .dw = Vec()};
-     size_t idx = 0;
-     for (auto ilayer = std::rbegin(this->layers); ilayer != std::rend(this->layers); ++ilayer) {
-         grad = (*ilayer)->grad(grad.dx);
-         if (gradients.size() != layers.size()) {
-             gradients.push_back(grad.dw);
-         } else {
-             gradients[idx] = gradients[idx] + grad.dw;
-         }
-         ++idx;
+  // Accumulates the gradients of n samples, labels being their class indices, and returns their summed loss
+  double train_batch(VecT<T> const& xs, uint8_t const * labels, size_t n) {
+    return this->train_batch(xs, labels, n, this->context, this->gradients.data());
+  }
+
+  // Accumulates into gradients, an arena laid out like params. xs can be a slice of a larger batch, it is read in place.
+  double train_batch(VecViewT<T> xs, uint8_t const * labels, size_t n, Context& context, T * gradients) const {
+     VecT<T> const& logits = this->forward_batch(xs, n, context);
+     double const loss = [&](){
+       profiler::Scope scope("loss", "backward");
+       return SoftmaxCrossEntropyT<T>::grad_batch(logits, labels, n, context.gradients[0]);
+     }();
+
+     // Layer i reads the gradient w.r.t. its output from one buffer and writes the one w.r.t. its input to the other
+     size_t const nlayers = this->layers.size();
+     for (size_t i = nlayers; i-- > 0;) {
+         Cache const cache = {.n = n, .x = i ? VecViewT<T>(context.activations[i - 1]) : xs, .fx = context.activations[i]};
+         profiler::Scope scope(this->layers[i]->name, "backward", this->layers[i]->backward_cost(cache.x.size()));
+         this->layers[i]->backward_batch(context.gradients[(nlayers - 1 - i) % 2], cache, gradients + this->offsets[i],
+                                         context.gradients[(nlayers - i) % 2], context.workspace);
      }
 
-     return -std::log(Vec::dot(output, y));
+     return loss;
   };
 
   void descend_gradient(double const rate) {
-    for (size_t i = 0; i < this->layers.size(); ++i) {
-      this->layers[i]->adjust_weights(-rate * this->gradients[this->gradients.size() - 1 - i]);
-      this->gradients[this->gradients.size() - 1 - i].zero();
-    }
+    // params -= rate * gradients, then gradients = 0
+    profiler::Scope scope("sgd", "update", {.flops = 2.0 * this->params.size(), .bytes = 4.0 * sizeof(T) * this->params.size()});
+    simd::kernels<T>().axpy(T(-rate), this->gradients.data(), this->params.data(), this->params.size());
+    this->reset();
+    this->params_changed();
   }
 
   void dump_weights(std::ostream& out) const {
-    for (auto const& layer : this->layers) {
-      layer->dump_weights(out);
+    if constexpr (std::is_same_v<T, double>) {
+      out.write((char const *)this->params.data(), this->params.size() * sizeof(double));
+    } else {
+      write_scalars(out, this->params.data(), this->params.size());
     }
   }
 
   void load_weights(std::istream& in) {
-    for (auto const& layer : this->layers) {
-      layer->load_weights(in);
+    if constexpr (std::is_same_v<T, double>) {
+      in.read((char *)this->params.data(), this->params.size() * sizeof(double));
+    } else {
+      read_scalars(in, this->params.data(), this->params.size());
     }
+    this->params_changed();
   }
 
+  // Draws the parameters in arena order, which is the order of the weights file
   template <class Random>
   void initialize(Random& r) {
-    for (auto const& layer : this->layers) {
-      layer->initialize(r);
+    for (auto& param : this->params) {
+      param = r();
     }
+    this->params_changed();
   }
 };
 
+using NeuralNetwork = NeuralNetworkT<double>;
@@ -0,0 +1,381 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <iomanip>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "counters.hpp"
+#include "allocations.hpp"
+
+// Scoped wall clock instrumentation. A profiler::Scope measures its lifetime and files it under a name (a layer,
+// a stage) and a category (forward, backward, ...). Every thread records into its own log, so scopes on different
+// threads never contend, and when profiling is off a scope costs one relaxed load.
+//
+// Per (name, category) the durations go into a histogram of powers of two nanoseconds, which summary prints. When
+// tracing is on every scope is kept as well, up to MAX_EVENTS per thread, and write_trace exports them in the
+// Chrome trace event format that chrome://tracing and Perfetto open.
+//
+// With counting on, every scope also reads the thread's hardware counters (see counters.hpp) at both ends and the
+// histogram sums their deltas. That costs two system calls per scope, so it is a separate switch.
+//
+// Scopes can also carry the Cost of their work. summary then adds a roofline table: achieved GFLOP/s and GB/s,
+// arithmetic intensity, and, given the machine's peaks, how far each scope is from what the roofline allows.
+//
+// In builds that track allocations, every scope also counts the heap allocations of its thread, and summary lists
+// them per call.
+//
+// Names and categories are not copied, they have to outlive the profiler: string literals, layer names.
+namespace profiler {
+
+// The work a scope does, counted analytically: floating point operations and the bytes it has to read or write
+// at least once
+struct Cost {
+  double flops = 0;
+  double bytes = 0;
+};
+
+constexpr size_t NBUCKETS = 40;              // Bucket i holds durations in [2^i, 2^(i+1)) ns
+constexpr size_t MAX_EVENTS = size_t(1) << 22; // Per thread, about 100MB
+
+struct Histogram {
+  char const * name;
+  char const * category;
+  uint64_t count = 0;
+  uint64_t total = 0; // ns
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  uint64_t buckets[NBUCKETS] = {};
+  counters::Sample counted = {}; // Summed deltas, when counting
+  Cost work = {};                 // Summed
+  allocations::Counts allocated = {}; // Summed, when tracking allocations
+
+  void add(uint64_t ns) {
+    ++this->count;
+    this->total += ns;
+    this->min = std::min(this->min, ns);
+    this->max = std::max(this->max, ns);
+    size_t bucket = 0;
+    while (bucket + 1 < NBUCKETS && (ns >> (bucket + 1))) ++bucket;
+    ++this->buckets[bucket];
+  }
+
+  void merge(Histogram const& other) {
+    this->count += other.count;
+    this->total += other.total;
+    this->min = std::min(this->min, other.min);
+    this->max = std::max(this->max, other.max);
+    for (size_t i = 0; i < NBUCKETS; ++i) this->buckets[i] += other.buckets[i];
+    for (size_t i = 0; i < counters::NCOUNTERS; ++i) this->counted.values[i] += other.counted.values[i];
+    this->work.flops += other.work.flops;
+    this->work.bytes += other.work.bytes;
+    this->allocated += other.allocated;
+  }
+
+  // The upper end of the bucket holding the p quantile, so within a factor 2 and never below it
+  uint64_t quantile(double p) const {
+    uint64_t const rank = std::max<uint64_t>(1, uint64_t(p * this->count + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NBUCKETS; ++i) {
+      seen += this->buckets[i];
+      if (seen >= rank) return std::min(this->max, (uint64_t(2) << i) - 1);
+    }
+    return this->max;
+  }
+
+  bool is(char const * name, char const * category) const {
+    return strcmp(this->name, name) == 0 && strcmp(this->category, category) == 0;
+  }
+};
+
+struct Event {
+  char const * name;
+  char const * category;
+  uint64_t start; // ns since the profiler started
+  uint64_t duration;
+};
+
+struct ThreadLog {
+  size_t id;
+  std::string name;
+  std::mutex mutex; // Only contended while exporting
+  std::vector<Histogram> histograms;
+  std::vector<Event> events;
+  size_t dropped = 0; // Events past MAX_EVENTS
+};
+
+struct State {
+  std::atomic<bool> profiling{false};
+  std::atomic<bool> tracing{false};
+  std::atomic<bool> counting{false};
+  double peak_gflops = 0; // 0 when unknown
+  double peak_gbs = 0;
+  std::chrono::steady_clock::time_point const origin = std::chrono::steady_clock::now();
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadLog>> threads; // Outlive their threads, so exports see finished threads too
+};
+
+inline State& state() {
+  static State s;
+  return s;
+}
+
+inline uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - state().origin).count();
+}
+
+// Histograms, plus events when tracing, plus hardware counters when counting
+inline void enable(bool tracing, bool counting) {
+  state().tracing = tracing;
+  state().counting = counting;
+  state().profiling = true;
+}
+
+// The machine's compute and memory bandwidth roofs, 0 for unknown
+inline void set_peaks(double gflops, double gbs) {
+  state().peak_gflops = gflops;
+  state().peak_gbs = gbs;
+}
+
+inline bool enabled() {
+  return state().profiling.load(std::memory_order_relaxed);
+}
+
+inline bool counting() {
+  return state().counting.load(std::memory_order_relaxed);
+}
+
+inline ThreadLog& this_thread() {
+  thread_local ThreadLog * log = nullptr;
+  if (!log) {
+    State& s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.threads.push_back(std::make_unique<ThreadLog>());
+    log = s.threads.back().get();
+    log->id = s.threads.size();
+    log->name = "thread " + std::to_string(log->id);
+  }
+  return *log;
+}
+
+// Shown instead of "thread N" in the trace
+inline void name_thread(char const * name) {
+  ThreadLog& log = this_thread();
+  std::lock_guard<std::mutex> lock(log.mutex);
+  log.name = name;
+}
+
+// delta is the change of the hardware counters over the scope, if counting
+inline void record(char const * name, char const * category, uint64_t start, uint64_t end, Cost const& work,
+                   allocations::Counts const& allocated, counters::Sample const * delta) {
+  ThreadLog& log = this_thread();
+  std::lock_guard<std::mutex> lock(log.mutex);
+
+  auto histogram = std::find_if(log.histograms.begin(), log.histograms.end(), [&](Histogram const& h){ return h.name == name && h.category == category; });
+  if (histogram == log.histograms.end()) {
+    log.histograms.push_back({.name = name, .category = category});
+    histogram = log.histograms.end() - 1;
+  }
+  histogram->add(end - start);
+  histogram->work.flops += work.flops;
+  histogram->work.bytes += work.bytes;
+  histogram->allocated += allocated;
+  if (delta) {
+    for (size_t i = 0; i < counters::NCOUNTERS; ++i) histogram->counted.values[i] += delta->values[i];
+  }
+
+  if (state().tracing.load(std::memory_order_relaxed)) {
+    if (log.events.size() < MAX_EVENTS) {
+      log.events.push_back({.name = name, .category = category, .start = start, .duration = end - start});
+    } else {
+      ++log.dropped;
+    }
+  }
+}
+
+struct Scope {
+  Scope(char const * name, char const * category, Cost work = {}): name{name}, category{category}, work{work}, active{enabled()} {
+    if (!this->active) return;
+    this->counting = profiler::counting();
+    if (this->counting) counters::read(this->before);
+    this->allocated = allocations::this_thread();
+    this->start = now();
+  }
+
+  Scope(Scope const&) = delete;
+  Scope& operator=(Scope const&) = delete;
+
+  ~Scope() {
+    if (!this->active) return;
+    uint64_t const end = now();
+    allocations::Counts const allocated = allocations::this_thread() - this->allocated;
+    if (!this->counting) {
+      record(this->name, this->category, this->start, end, this->work, allocated, nullptr);
+      return;
+    }
+    counters::Sample after;
+    counters::read(after);
+    for (size_t i = 0; i < counters::NCOUNTERS; ++i) after.values[i] -= this->before.values[i];
+    record(this->name, this->category, this->start, end, this->work, allocated, &after);
+  }
+
+  private:
+  char const * name;
+  char const * category;
+  Cost work;
+  bool active;
+  bool counting = false;
+  uint64_t start = 0;
+  allocations::Counts allocated = {}; // At the start
+  counters::Sample before = {};
+};
+
+// The histograms of all threads merged by name and category
+inline std::vector<Histogram> histograms() {
+  std::vector<Histogram> merged;
+  State& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  for (auto const& log : s.threads) {
+    std::lock_guard<std::mutex> log_lock(log->mutex);
+    for (Histogram const& h : log->histograms) {
+      auto m = std::find_if(merged.begin(), merged.end(), [&](Histogram const& o){ return o.is(h.name, h.category); });
+      if (m == merged.end()) {
+        merged.push_back(h);
+      } else {
+        m->merge(h);
+      }
+    }
+  }
+  return merged;
+}
+
+// The scopes with a Cost against the roofline, plus their total. Rates are per thread: work over time spent in the
+// scope. A scope whose intensity times the bandwidth roof is below the compute roof is memory bound, and its
+// attainable rate is that product.
+inline void roofline(std::ostream& out, std::vector<Histogram> const& hs) {
+  double const peak_gflops = state().peak_gflops;
+  double const peak_gbs = state().peak_gbs;
+  bool const peaks = peak_gflops > 0 || peak_gbs > 0;
+
+  Histogram all = {.name = "all", .category = ""};
+  for (Histogram const& h : hs) {
+    if (h.work.flops > 0) all.merge(h);
+  }
+  if (all.work.flops == 0) return;
+
+  out << std::endl << std::left << std::setw(12) << "name" << std::setw(10) << "category" << std::right
+      << std::setw(12) << "MFLOP/call" << std::setw(10) << "GFLOP/s" << std::setw(10) << "GB/s" << std::setw(10) << "FLOP/B";
+  if (peaks) out << std::setw(10) << "% roof" << std::setw(10) << "bound";
+  out << std::endl;
+
+  auto const row = [&](Histogram const& h){
+    double const seconds = h.total / 1e9;
+    double const gflops = h.work.flops / seconds / 1e9;
+    double const intensity = h.work.flops / h.work.bytes;
+    out << std::left << std::setw(12) << h.name << std::setw(10) << h.category << std::right << std::setprecision(3)
+        << std::setw(12) << h.work.flops / 1e6 / h.count << std::setprecision(2) << std::setw(10) << gflops
+        << std::setw(10) << h.work.bytes / seconds / 1e9 << std::setw(10) << intensity;
+    if (peaks) {
+      double const memory_roof = peak_gbs > 0 ? intensity * peak_gbs : INFINITY;
+      double const compute_roof = peak_gflops > 0 ? peak_gflops : INFINITY;
+      out << std::setw(10) << 100 * gflops / std::min(memory_roof, compute_roof)
+          << std::setw(10) << (memory_roof < compute_roof ? "memory" : "compute");
+    }
+    out << std::endl;
+  };
+  for (Histogram const& h : hs) {
+    if (h.work.flops > 0) row(h);
+  }
+  row(all);
+}
+
+// One line per name and category, the most expensive first. Quantiles are bucket bounds.
+inline void summary(std::ostream& out) {
+  std::vector<Histogram> hs = histograms();
+  std::sort(hs.begin(), hs.end(), [](Histogram const& l, Histogram const& r){ return l.total > r.total; });
+
+  auto const us = [](uint64_t ns){ return ns / 1000.0; };
+  out << std::left << std::setw(12) << "name" << std::setw(10) << "category" << std::right
+      << std::setw(10) << "count" << std::setw(12) << "total ms" << std::setw(11) << "mean us"
+      << std::setw(11) << "p50 us" << std::setw(11) << "p90 us" << std::setw(11) << "p99 us" << std::setw(11) << "max us" << std::endl;
+  out << std::fixed << std::setprecision(1);
+  for (Histogram const& h : hs) {
+    out << std::left << std::setw(12) << h.name << std::setw(10) << h.category << std::right
+        << std::setw(10) << h.count << std::setw(12) << h.total / 1e6 << std::setw(11) << us(h.total) / h.count
+        << std::setw(11) << us(h.quantile(0.5)) << std::setw(11) << us(h.quantile(0.9)) << std::setw(11) << us(h.quantile(0.99))
+        << std::setw(11) << us(h.max) << std::endl;
+  }
+
+  roofline(out, hs);
+
+  if (allocations::TRACKING) {
+    out << std::endl << std::left << std::setw(12) << "name" << std::setw(10) << "category" << std::right
+        << std::setw(14) << "allocs/call" << std::setw(12) << "KB/call" << std::endl;
+    out << std::setprecision(1);
+    for (Histogram const& h : hs) {
+      out << std::left << std::setw(12) << h.name << std::setw(10) << h.category << std::right
+          << std::setw(14) << double(h.allocated.count) / h.count << std::setw(12) << h.allocated.bytes / 1024.0 / h.count << std::endl;
+    }
+  }
+
+  unsigned const available = counters::available();
+  if (counting() && !available) {
+    out << std::endl << "No hardware counter could be opened" << std::endl;
+  }
+  if (counting() && available) {
+    // Per call, and misses per thousand instructions; "-" where the counter couldn't be opened
+    auto const has = [available](size_t counter){ return (available >> counter) & 1; };
+    auto const column = [&out](bool known, double value){
+      if (known) out << std::setw(12) << value; else out << std::setw(12) << "-";
+    };
+    out << std::endl << std::left << std::setw(12) << "name" << std::setw(10) << "category" << std::right
+        << std::setw(12) << "kcycles" << std::setw(12) << "kinstr" << std::setw(12) << "IPC"
+        << std::setw(12) << "L1D MPKI" << std::setw(12) << "LLC MPKI" << std::setw(12) << "branch MPKI" << std::setw(12) << "LLC/MFLOP" << std::endl;
+    out << std::setprecision(2);
+    for (Histogram const& h : hs) {
+      double const instructions = h.counted.values[counters::Instructions];
+      bool const per_instruction = has(counters::Instructions) && instructions > 0;
+      out << std::left << std::setw(12) << h.name << std::setw(10) << h.category << std::right;
+      column(has(counters::Cycles), h.counted.values[counters::Cycles] / 1e3 / h.count);
+      column(has(counters::Instructions), instructions / 1e3 / h.count);
+      column(per_instruction && has(counters::Cycles), instructions / h.counted.values[counters::Cycles]);
+      column(per_instruction && has(counters::L1DMisses), 1e3 * h.counted.values[counters::L1DMisses] / instructions);
+      column(per_instruction && has(counters::LLCMisses), 1e3 * h.counted.values[counters::LLCMisses] / instructions);
+      column(per_instruction && has(counters::BranchMisses), 1e3 * h.counted.values[counters::BranchMisses] / instructions);
+      column(has(counters::LLCMisses) && h.work.flops > 0, 1e6 * h.counted.values[counters::LLCMisses] / h.work.flops);
+      out << std::endl;
+    }
+  }
+  out << std::defaultfloat << std::setprecision(6);
+}
+
+// Complete ("X") events in microseconds, one track per thread
+inline void write_trace(std::ostream& out) {
+  State& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  size_t dropped = 0;
+  out << std::fixed << std::setprecision(3);
+  for (auto const& log : s.threads) {
+    std::lock_guard<std::mutex> log_lock(log->mutex);
+    out << (first ? "" : ",") << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << log->id
+        << ",\"args\":{\"name\":\"" << log->name << "\"}}";
+    first = false;
+    for (Event const& e : log->events) {
+      out << ",\n{\"ph\":\"X\",\"name\":\"" << e.name << "\",\"cat\":\"" << e.category << "\",\"pid\":1,\"tid\":" << log->id
+          << ",\"ts\":" << e.start / 1e3 << ",\"dur\":" << e.duration / 1e3 << "}";
+    }
+    dropped += log->dropped;
+  }
+  out << "\n],\"otherData\":{\"dropped_events\":" << dropped << "}}" << std::endl;
+  out << std::defaultfloat << std::setprecision(6);
+}
+
+}
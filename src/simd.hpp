@@ -0,0 +1,290 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <cstdlib>
+#include <iostream>
+
+// Hand vectorized kernels for the math.hpp primitives.
+// Each kernel body is written once against GCC vector types and compiled for every instruction set through the
+// target attribute. The widest variant the CPU supports is picked on first use via cpuid, so one binary runs on
+// every x86 machine. Setting the MNIST_SIMD environment variable to scalar, sse2, avx2 or avx512 caps the level.
+namespace simd {
+
+enum class Level {
+  Scalar,
+  SSE2,
+  AVX2,
+  AVX512,
+};
+
+inline char const * name(Level level) {
+  switch (level) {
+    case Level::Scalar: return "scalar";
+    case Level::SSE2: return "sse2";
+    case Level::AVX2: return "avx2";
+    case Level::AVX512: return "avx512";
+  }
+  return "?";
+}
+
+inline Level detect() {
+  Level level = Level::Scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) level = Level::SSE2;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) level = Level::AVX2;
+  if (__builtin_cpu_supports("avx512f")) level = Level::AVX512;
+#endif
+
+  if (char const * const cap = std::getenv("MNIST_SIMD")) {
+    for (Level l : {Level::Scalar, Level::SSE2, Level::AVX2, Level::AVX512}) {
+      if (strcmp(cap, name(l)) == 0) {
+        if (l < level) level = l;
+        return level;
+      }
+    }
+    std::cerr << "Ignoring unknown MNIST_SIMD level: " << cap << std::endl;
+  }
+  return level;
+}
+
+inline Level level() {
+  static Level const l = detect();
+  return l;
+}
+
+// How exp, and the sigmoid built on it, are computed
+enum class Accuracy {
+  Exact,    // std::exp, one element at a time
+  Accurate, // Vectorized, degree 13 (double) or 7 (float) polynomial: the sigmoid is within 2.5 ulp, like Exact's
+  Fast,     // Vectorized, degree 7 (double) or 4 (float) polynomial: the sigmoid is within 1e-8 (double) or 6e-5 (float) relative
+};
+
+// The sigmoid's bounds above, for --check-sigmoid: in ulp for Exact and Accurate, relative for Fast
+template <class T>
+constexpr double sigmoid_error_bound(Accuracy accuracy) {
+  if (accuracy != Accuracy::Fast) return 2.5;
+  return sizeof(T) == sizeof(double) ? 1e-8 : 6e-5;
+}
+
+inline char const * name(Accuracy accuracy) {
+  switch (accuracy) {
+    case Accuracy::Exact: return "exact";
+    case Accuracy::Accurate: return "accurate";
+    case Accuracy::Fast: return "fast";
+  }
+  return "?";
+}
+
+// A GCC vector of BYTES / sizeof(T) elements. Vectors wider than the target's registers are split by the compiler.
+template <class T, size_t BYTES>
+struct Vector {
+  typedef T type __attribute__((vector_size(BYTES)));
+};
+
+#define SIMD_INLINE __attribute__((always_inline)) inline
+
+/*********** Kernel bodies, instantiated per instruction set ********************/
+namespace body {
+
+// out = l + r
+template <class T, size_t BYTES>
+SIMD_INLINE void add(T const * l, T const * r, T * out, size_t n) {
+  using V = typename Vector<T, BYTES>::type;
+  constexpr size_t N = BYTES / sizeof(T);
+
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    V lv, rv;
+    memcpy(&lv, l + i, BYTES); memcpy(&rv, r + i, BYTES);
+    lv += rv;
+    memcpy(out + i, &lv, BYTES);
+  }
+  for (; i < n; ++i) out[i] = l[i] + r[i];
+}
+
+template <class T, size_t BYTES>
+SIMD_INLINE void axpy(T a, T const * x, T * y, size_t n) {
+  using V = typename Vector<T, BYTES>::type;
+  constexpr size_t N = BYTES / sizeof(T);
+
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    V xv, yv;
+    memcpy(&xv, x + i, BYTES); memcpy(&yv, y + i, BYTES);
+    yv += a * xv;
+    memcpy(y + i, &yv, BYTES);
+  }
+  for (; i < n; ++i) y[i] += a * x[i];
+}
+
+// The constants of exp's range reduction: x = k*ln(2) + r with |r| <= ln(2)/2, so exp(x) = 2^k * exp(r)
+template <class T> struct ExpTraits;
+template <> struct ExpTraits<double> {
+  using Int = int64_t;
+  static constexpr double lo = -708.0, hi = 709.0; // 2^k stays a normal number
+  static constexpr double ln2_hi = 0x1.62e42fefa3800p-1, ln2_lo = 0x1.ef35793c76730p-45;
+  static constexpr double shifter = 0x1.8p52; // Adding it rounds to an integer that lands in the low mantissa bits
+  static constexpr int mantissa = 52, bias = 1023;
+};
+template <> struct ExpTraits<float> {
+  using Int = int32_t;
+  static constexpr float lo = -87.0f, hi = 88.0f;
+  static constexpr float ln2_hi = 0x1.62e4p-1f, ln2_lo = 0x1.7f7d1cp-20f;
+  static constexpr float shifter = 0x1.8p23f;
+  static constexpr int mantissa = 23, bias = 127;
+};
+
+// x = exp(x) in place, with a DEGREE Taylor polynomial on the reduced argument
+template <class T, size_t BYTES, int DEGREE>
+SIMD_INLINE void exp_vector(typename Vector<T, BYTES>::type& x) {
+  using V = typename Vector<T, BYTES>::type;
+  using E = ExpTraits<T>;
+  using I = typename Vector<typename E::Int, BYTES>::type;
+
+  x = x < E::lo ? V{} + E::lo : x;
+  x = x > E::hi ? V{} + E::hi : x;
+
+  V const t = x * T(1.4426950408889634) + E::shifter;
+  V const k = t - E::shifter;
+  V const r = (x - k * E::ln2_hi) - k * E::ln2_lo;
+
+  // Horner form of sum(r^i / i!)
+  V p = V{} + T(1);
+  for (int i = DEGREE; i >= 1; --i) {
+    p = p * r * (T(1) / T(i)) + T(1);
+  }
+
+  // 2^k by writing k + bias into the exponent bits; the low bits of t hold k
+  I ti;
+  memcpy(&ti, &t, BYTES);
+  I shifter_bits;
+  V const shifter_v = V{} + E::shifter;
+  memcpy(&shifter_bits, &shifter_v, BYTES);
+  I const bits = ((ti - shifter_bits) + E::bias) << E::mantissa;
+  V scale;
+  memcpy(&scale, &bits, BYTES);
+  x = p * scale;
+}
+
+// out = 1 / (1 + exp(-x))
+template <class T, size_t BYTES, int DEGREE>
+SIMD_INLINE void sigmoid(T const * x, T * out, size_t n) {
+  using V = typename Vector<T, BYTES>::type;
+  constexpr size_t N = BYTES / sizeof(T);
+
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    V xv;
+    memcpy(&xv, x + i, BYTES);
+    xv = -xv;
+    exp_vector<T, BYTES, DEGREE>(xv);
+    xv = T(1) / (T(1) + xv);
+    memcpy(out + i, &xv, BYTES);
+  }
+  // The tail goes through a padded vector, so every element gets the same rounding
+  if (i < n) {
+    V xv = {};
+    memcpy(&xv, x + i, (n - i) * sizeof(T));
+    xv = -xv;
+    exp_vector<T, BYTES, DEGREE>(xv);
+    xv = T(1) / (T(1) + xv);
+    memcpy(out + i, &xv, (n - i) * sizeof(T));
+  }
+}
+
+// out = g * s * (1 - s), the sigmoid's gradient from its output s
+template <class T, size_t BYTES>
+SIMD_INLINE void dsigmoid(T const * s, T const * g, T * out, size_t n) {
+  using V = typename Vector<T, BYTES>::type;
+  constexpr size_t N = BYTES / sizeof(T);
+
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    V sv, gv;
+    memcpy(&sv, s + i, BYTES); memcpy(&gv, g + i, BYTES);
+    gv *= sv * (T(1) - sv);
+    memcpy(out + i, &gv, BYTES);
+  }
+  for (; i < n; ++i) out[i] = g[i] * s[i] * (T(1) - s[i]);
+}
+
+// The polynomial degrees of the Accurate and Fast levels
+template <class T> constexpr int ACCURATE_DEGREE = sizeof(T) == 8 ? 13 : 7;
+template <class T> constexpr int FAST_DEGREE = sizeof(T) == 8 ? 7 : 4;
+
+}
+
+/*********** Portable fallback ********************/
+template <class T>
+struct Scalar {
+  static void add(T const * l, T const * r, T * out, size_t n) {
+    for (size_t i = 0; i < n; ++i) out[i] = l[i] + r[i];
+  }
+  static void axpy(T a, T const * x, T * y, size_t n) {
+    for (size_t i = 0; i < n; ++i) y[i] += a * x[i];
+  }
+  // Generic vectors, which the compiler lowers to whatever the target has
+  static void sigmoid(T const * x, T * out, size_t n) { body::sigmoid<T, 16, body::ACCURATE_DEGREE<T>>(x, out, n); }
+  static void sigmoid_fast(T const * x, T * out, size_t n) { body::sigmoid<T, 16, body::FAST_DEGREE<T>>(x, out, n); }
+  static void dsigmoid(T const * s, T const * g, T * out, size_t n) {
+    for (size_t i = 0; i < n; ++i) out[i] = g[i] * s[i] * (T(1) - s[i]);
+  }
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+// Instantiates the kernel bodies for one instruction set
+#define SIMD_DEFINE_ISA(NAME, TARGET, BYTES) \
+template <class T> \
+struct NAME { \
+  __attribute__((target(TARGET))) static void add(T const * l, T const * r, T * out, size_t n) { body::add<T, BYTES>(l, r, out, n); } \
+  __attribute__((target(TARGET))) static void axpy(T a, T const * x, T * y, size_t n) { body::axpy<T, BYTES>(a, x, y, n); } \
+  __attribute__((target(TARGET))) static void sigmoid(T const * x, T * out, size_t n) { body::sigmoid<T, BYTES, body::ACCURATE_DEGREE<T>>(x, out, n); } \
+  __attribute__((target(TARGET))) static void sigmoid_fast(T const * x, T * out, size_t n) { body::sigmoid<T, BYTES, body::FAST_DEGREE<T>>(x, out, n); } \
+  __attribute__((target(TARGET))) static void dsigmoid(T const * s, T const * g, T * out, size_t n) { body::dsigmoid<T, BYTES>(s, g, out, n); } \
+};
+
+SIMD_DEFINE_ISA(SSE2, "sse2", 16)
+SIMD_DEFINE_ISA(AVX2, "avx2,fma", 32)
+SIMD_DEFINE_ISA(AVX512, "avx512f", 64)
+#undef SIMD_DEFINE_ISA
+#endif
+
+template <class T>
+struct Kernels {
+  void (*add)(T const * l, T const * r, T * out, size_t n);
+  void (*axpy)(T a, T const * x, T * y, size_t n);
+  void (*sigmoid)(T const * x, T * out, size_t n);      // Accuracy::Accurate
+  void (*sigmoid_fast)(T const * x, T * out, size_t n); // Accuracy::Fast
+  void (*dsigmoid)(T const * s, T const * g, T * out, size_t n);
+};
+
+template <template <class> class ISA, class T>
+Kernels<T> kernels_of() {
+  return {
+    .add = ISA<T>::add,
+    .axpy = ISA<T>::axpy,
+    .sigmoid = ISA<T>::sigmoid,
+    .sigmoid_fast = ISA<T>::sigmoid_fast,
+    .dsigmoid = ISA<T>::dsigmoid,
+  };
+}
+
+// The kernels of the widest instruction set supported by this CPU
+template <class T>
+Kernels<T> const& kernels() {
+  static Kernels<T> const k = [](){
+    switch (level()) {
+#if defined(__x86_64__) || defined(__i386__)
+      case Level::AVX512: return kernels_of<AVX512, T>();
+      case Level::AVX2: return kernels_of<AVX2, T>();
+      case Level::SSE2: return kernels_of<SSE2, T>();
+#endif
+      default: return kernels_of<Scalar, T>();
+    }
+  }();
+  return k;
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include <stddef.h>
+
+// Lock-free bounded queue between exactly one producer thread and one consumer thread.
+// push never blocks: when the queue is full the element is dropped and push returns false.
+template <class T, size_t N>
+struct SpscQueue {
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  bool push(T const& value) {
+    size_t const head = this->head.load(std::memory_order_relaxed);
+    if (head - this->tail.load(std::memory_order_acquire) == N) return false;
+    this->buffer[head & (N - 1)] = value;
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::optional<T> pop() {
+    size_t const tail = this->tail.load(std::memory_order_relaxed);
+    if (tail == this->head.load(std::memory_order_acquire)) return std::nullopt;
+    T value = this->buffer[tail & (N - 1)];
+    this->tail.store(tail + 1, std::memory_order_release);
+    return value;
+  }
+
+  private:
+  // On separate cache lines, so the producer and the consumer don't invalidate each other's
+  alignas(64) std::atomic<size_t> head{0}; // Written by the producer
+  alignas(64) std::atomic<size_t> tail{0}; // Written by the consumer
+  alignas(64) T buffer[N];
+};
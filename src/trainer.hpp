@@ -0,0 +1,145 @@
+#pragma once
+#include "neuralnetwork.hpp"
+#include "allocations.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Data-parallel train_batch: the batch is split into one contiguous slice per thread, each thread runs the slice
+// through the shared network with its own context and gradient arena, and the arenas are summed into the network's
+// gradients afterwards, in thread order. With one thread this is exactly NeuralNetworkT::train_batch.
+//
+// The threads live as long as the trainer and sleep between batches.
+template <class T>
+struct ParallelTrainerT {
+  using Context = typename NeuralNetworkT<T>::Context;
+
+  struct Worker {
+    Context context;
+    AlignedVector<T> gradients;
+    double loss = 0;
+    allocations::Counts allocated; // By the last run, charged to the calling thread
+  };
+
+  NeuralNetworkT<T>& nn;
+  std::vector<Worker> workers; // workers[0] is the calling thread
+
+  ParallelTrainerT(NeuralNetworkT<T>& nn, size_t nthreads): nn{nn}, workers(std::max<size_t>(nthreads, 1)) {
+    for (size_t i = 1; i < this->workers.size(); ++i) {
+      this->workers[i].gradients.resize(this->nn.params.size());
+      this->threads.emplace_back([this, i](){ this->work(i); });
+    }
+  }
+
+  ParallelTrainerT(ParallelTrainerT const&) = delete;
+  ParallelTrainerT& operator=(ParallelTrainerT const&) = delete;
+
+  ~ParallelTrainerT() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->start.notify_all();
+    for (auto& thread : this->threads) {
+      thread.join();
+    }
+  }
+
+  // Same contract as NeuralNetworkT::train_batch: adds the gradients of the n samples to nn.gradients and returns
+  // their summed loss
+  double train_batch(VecT<T> const& xs, uint8_t const * labels, size_t n) {
+    if (this->workers.size() == 1) {
+      return this->nn.train_batch(xs, labels, n);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->job = {.xs = &xs, .labels = labels, .n = n};
+      this->pending = this->threads.size();
+      ++this->generation;
+    }
+    this->start.notify_all();
+
+    this->run(0);
+
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->done.wait(lock, [this](){ return this->pending == 0; });
+    }
+    for (size_t i = 1; i < this->workers.size(); ++i) {
+      allocations::this_thread() += this->workers[i].allocated;
+    }
+
+    // Reduce
+    double const nreduced = (this->workers.size() - 1) * this->nn.gradients.size();
+    profiler::Scope scope("reduce", "update", {.flops = nreduced, .bytes = 4.0 * sizeof(T) * nreduced});
+    auto const& k = simd::kernels<T>();
+    double loss = this->workers[0].loss;
+    for (size_t i = 1; i < this->workers.size(); ++i) {
+      Worker& worker = this->workers[i];
+      k.add(this->nn.gradients.data(), worker.gradients.data(), this->nn.gradients.data(), this->nn.gradients.size());
+      std::fill(worker.gradients.begin(), worker.gradients.end(), T(0));
+      loss += worker.loss;
+    }
+    return loss;
+  }
+
+  private:
+  struct Job {
+    VecT<T> const * xs;
+    uint8_t const * labels;
+    size_t n;
+  };
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable done;
+  Job job = {};
+  size_t generation = 0;
+  size_t pending = 0;
+  bool stopping = false;
+
+  // Trains worker i's slice of the current job
+  void run(size_t i) {
+    Worker& worker = this->workers[i];
+    allocations::Measure const measure;
+    size_t const n = this->job.n;
+    size_t const begin = n * i / this->workers.size();
+    size_t const end = n * (i + 1) / this->workers.size();
+    worker.loss = 0;
+    worker.allocated = {};
+    if (begin == end) return;
+
+    // The slice is read in place, and the calling thread accumulates straight into the network
+    size_t const xsize = this->job.xs->size() / n;
+    VecViewT<T> const xs(this->job.xs->elements.data() + begin * xsize, (end - begin) * xsize);
+    T * const gradients = i == 0 ? this->nn.gradients.data() : worker.gradients.data();
+    worker.loss = this->nn.train_batch(xs, this->job.labels + begin, end - begin, i == 0 ? this->nn.context : worker.context, gradients);
+    worker.allocated = measure.elapsed();
+  }
+
+  void work(size_t i) {
+    profiler::name_thread(("worker " + std::to_string(i)).c_str());
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->start.wait(lock, [this, seen](){ return this->stopping || this->generation != seen; });
+        if (this->stopping) return;
+        seen = this->generation;
+      }
+
+      this->run(i);
+
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        --this->pending;
+      }
+      this->done.notify_one();
+    }
+  }
+};
+
+using ParallelTrainer = ParallelTrainerT<double>;
@@ -0,0 +1,78 @@
+#pragma once
+#include "math.hpp"
+#include <algorithm>
+#include <vector>
+#include <stddef.h>
+
+// Bump allocator for the scratch buffers of a training step: take hands out ALIGN aligned pieces of one block by
+// moving an offset, and reset, or the end of a Frame, gives them all back at once by moving it back.
+//
+// The block is sized up front with reserve, from what the layers say they need. Should a step take more anyway,
+// the excess comes from separate overflow blocks, which the next reset merges into one bigger block. Either way
+// only the first steps allocate.
+struct Workspace {
+  static constexpr size_t ALIGN = 64;
+
+  // The bytes take(n) uses, for adding up reserve sizes
+  template <class T>
+  static constexpr size_t bytes(size_t n) {
+    return (n * sizeof(T) + ALIGN - 1) / ALIGN * ALIGN;
+  }
+
+  // Rewinds the workspace to where it was when the frame was made, giving back everything taken in between
+  struct Frame {
+    explicit Frame(Workspace& workspace): workspace{workspace}, offset{workspace.offset} {}
+    Frame(Frame const&) = delete;
+    Frame& operator=(Frame const&) = delete;
+    ~Frame() {
+      this->workspace.offset = this->offset;
+    }
+
+    private:
+    Workspace& workspace;
+    size_t const offset;
+  };
+
+  Workspace() = default;
+  Workspace(Workspace const&) = delete;
+  Workspace& operator=(Workspace const&) = delete;
+  Workspace(Workspace&&) = default;
+  Workspace& operator=(Workspace&&) = default;
+
+  // Makes sure that bytes fit without overflowing. Only between steps, it moves the block.
+  void reserve(size_t bytes) {
+    if (bytes > this->block.size()) {
+      this->block = AlignedVector<unsigned char>(bytes);
+    }
+  }
+
+  // n uninitialized Ts, valid until the workspace is reset or rewound past them
+  template <class T>
+  T * take(size_t n) {
+    size_t const size = bytes<T>(n);
+    this->peak = std::max(this->peak, this->offset + size);
+    if (this->offset + size <= this->block.size()) {
+      T * const p = reinterpret_cast<T *>(this->block.data() + this->offset);
+      this->offset += size;
+      return p;
+    }
+    // Past the block; the offset still grows, so peak says how big the block has to become
+    this->offset += size;
+    this->overflow.emplace_back(size);
+    return reinterpret_cast<T *>(this->overflow.back().data());
+  }
+
+  void reset() {
+    this->offset = 0;
+    if (!this->overflow.empty()) {
+      this->overflow.clear();
+      this->reserve(this->peak);
+    }
+  }
+
+  private:
+  AlignedVector<unsigned char> block;
+  std::vector<AlignedVector<unsigned char>> overflow;
+  size_t offset = 0; // Bytes taken, overflow included
+  size_t peak = 0;
+};